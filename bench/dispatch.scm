@@ -0,0 +1,7 @@
+;;; Dispatch benchmark: fib with its body replaced at run time, which leaves
+;;; eval to run it from source, through every special form check per step
+;;; usage: time build/microlisp src/lib.scm ../bench/dispatch.scm
+(define (fib n) n)
+(mutate-procedure-body fib '(if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(print (fib 30))
+(exit)
@@ -0,0 +1,8 @@
+;;; Eval-heavy benchmark: naive recursive fibonacci
+;;; usage: time build/microlisp ../bench/fib.scm
+(define (fib n)
+  (if (< n 2)
+    n
+    (+ (fib (- n 1)) (fib (- n 2)))))
+(print (fib 30))
+(exit)
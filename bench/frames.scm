@@ -0,0 +1,13 @@
+;;; Call-heavy benchmark: procedures of a few parameters and internal defines,
+;;; where building each call's frame is most of the work
+;;; usage: time build/microlisp ../bench/frames.scm
+(define (area x0 y0 x1 y1)
+  (define w (- x1 x0))
+  (define h (- y1 y0))
+  (* w h))
+(define (loop i acc)
+  (if (= i 0)
+    acc
+    (loop (- i 1) (+ acc (area i i (+ i 3) (+ i 4))))))
+(print (loop 200000 0))
+(exit)
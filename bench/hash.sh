@@ -0,0 +1,73 @@
+#!/bin/bash
+# Keyed lookup benchmark: store N symbol keys in an alist searched with assoc
+# and in a hash table, then look up randomly chosen keys in each. Every run is
+# timed once without any lookups, to take out reading and storing the keys,
+# and the difference is reported per lookup.
+# usage: bench/hash.sh [path/to/microlisp]
+BIN=${1:-scheme-gc/build/microlisp}
+SRC=$(mktemp /tmp/hash-XXXXXX.scm)
+trap 'rm -f $SRC' EXIT
+
+# generate N P KIND: N keys, P lookups, stored by KIND
+generate() {
+	awk -v n=$1 -v p=$2 -v kind=$3 'BEGIN {
+	srand(1);
+	printf "(define keys \047(";
+	for (i = 0; i < n; i++)
+		printf " k%d", i;
+	printf "))\n(define probes \047(";
+	for (i = 0; i < p; i++)
+		printf " k%d", int(rand() * n);
+	print "))";
+	if (kind == "assoc") {
+		# as in lib.scm
+		print "(define (assoc key list)";
+		print "  (if (null? list) \047()";
+		print "    (if (eq? key (car (car list))) (car list)";
+		print "      (assoc key (cdr list)))))";
+		print "(define (fill keys acc)";
+		print "  (if (null? keys) acc";
+		print "    (fill (cdr keys) (cons (cons (car keys) 1) acc))))";
+		print "(define store (fill keys \047()))";
+		print "(define (lookup key) (cdr (assoc key store)))";
+	} else {
+		print "(define store (make-hash-table))";
+		print "(define (fill keys)";
+		print "  (if (null? keys) \047done";
+		print "    (begin (hash-table-set! store (car keys) 1)";
+		print "      (fill (cdr keys)))))";
+		print "(fill keys)";
+		print "(define (lookup key) (hash-table-ref store key))";
+	}
+	print "(define (probe keys found)";
+	print "  (if (null? keys) found";
+	print "    (probe (cdr keys) (+ found (lookup (car keys))))))";
+	print "(print (probe probes 0))";
+	print "(exit)";
+}' > $SRC
+}
+
+# run: prints the wall time of one run in microseconds
+run() {
+	local start=$(date +%s%N)
+	$BIN $SRC < /dev/null > /dev/null
+	echo $((($(date +%s%N) - start) / 1000))
+}
+
+for N in 10 1000 100000; do
+	case $N in
+	10) P=100000 ;;
+	1000) P=10000 ;;
+	*) P=200 ;;
+	esac
+	for KIND in assoc table; do
+		generate $N 0 $KIND
+		BASE=$(run)
+		generate $N $P $KIND
+		TOTAL=$(run)
+		$BIN $SRC < /dev/null | grep -qx $P || echo "$KIND: wrong lookups"
+		awk -v n=$N -v kind=$KIND -v p=$P -v t=$((TOTAL - BASE)) 'BEGIN {
+		printf "%6d keys, %-5s %6d lookups: %9.3f us per lookup\n",
+			n, kind, p, t / p }'
+	done
+done
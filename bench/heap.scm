@@ -0,0 +1,33 @@
+;;; GC heap sizing benchmark: a live set that swings between nothing and a
+;;; 300k element list, with short lived garbage churned in between. Prints the
+;;; number of collections and of slabs the pool had to allocate and free
+;;; usage: build/microlisp ../bench/heap.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons n acc))))
+(define live '())
+(define (churn k)
+  (if (= k 0)
+    'done
+    (begin
+      (build 1000 '())
+      (churn (- k 1)))))
+(define (swing k)
+  (if (= k 0)
+    'done
+    (begin
+      (set! live (build 300000 '()))
+      (churn 100)
+      (set! live '())
+      (churn 100)
+      (swing (- k 1)))))
+(swing 10)
+(define (stat key alist)
+  (if (eq? key (car (car alist)))
+    (cdr (car alist))
+    (stat key (cdr alist))))
+(define stats (gc-stats))
+(print (list (stat 'minor-collections stats) (stat 'full-collections stats)
+             (stat 'slabs-allocated stats) (stat 'slabs-freed stats)))
+(exit)
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Startup benchmark: load lib.scm and a generated rule file of N rules, then
+# exit, either from source or from a heap image dumped after loading them.
+# Prints the best wall time of a few runs of each.
+# usage: bench/image.sh [path/to/microlisp] [N]
+BIN=${1:-scheme-gc/build/microlisp}
+N=${2:-20000}
+LIB=$(dirname $0)/../scheme-gc/src/lib.scm
+DIR=$(mktemp -d /tmp/image-XXXXXX)
+trap 'rm -rf $DIR' EXIT
+
+# every rule is a quoted condition and action, with a procedure to apply it
+awk -v n=$N 'BEGIN {
+	print "(define rules (make-hash-table))";
+	for (i = 0; i < n; i++) {
+		printf "(define (rule-%d x) (if (> x %d) (quote (raise alert-%d)) ", i, i, i % 97;
+		printf "(quote (log \"rule %d below threshold\" %d))))\n", i, i;
+		printf "(hash-table-set! rules (quote rule-%d) ", i;
+		printf "(quote ((when (metric-%d > %d)) (then notify team-%d))))\n", i % 500, i, i % 13;
+	}
+}' > $DIR/rules.scm
+echo "(exit)" > $DIR/exit.scm
+$BIN $LIB $DIR/rules.scm --dump-image $DIR/rules.img < /dev/null > /dev/null
+
+# best: prints the best wall time of 5 runs of the command, in milliseconds
+best() {
+	local i start t min=
+	for i in 1 2 3 4 5; do
+		start=$(date +%s%N)
+		"$@" < /dev/null > /dev/null
+		t=$((($(date +%s%N) - start) / 1000000))
+		[ -z "$min" ] || [ $t -lt $min ] && min=$t
+	done
+	echo ${min}ms
+}
+
+echo "rules: $N, $(du -k $DIR/rules.scm | cut -f1)KB of source," \
+	"$(du -k $DIR/rules.img | cut -f1)KB image"
+echo "source: $(best $BIN $LIB $DIR/rules.scm $DIR/exit.scm)"
+echo "image:  $(best $BIN --image $DIR/rules.img $DIR/exit.scm)"
@@ -0,0 +1,23 @@
+#!/bin/bash
+# Symbol table microbenchmark: read N distinct symbols and keep them live so
+# every one of them stays interned.
+# usage: bench/intern.sh [path/to/microlisp] [N]
+BIN=${1:-scheme-gc/build/microlisp}
+N=${2:-1000000}
+SRC=$(mktemp /tmp/intern-XXXXXX.scm)
+trap 'rm -f $SRC' EXIT
+
+awk -v n=$N 'BEGIN {
+	printf "(define syms (quote (";
+	for (i = 0; i < n; i++) {
+		if (i % 100 == 0)
+			printf "%s(", (i ? ")\n" : "");
+		printf "sym-%d ", i;
+	}
+	print "))))";
+	print "(print (eq? (quote sym-0) (car (car syms))))";
+	print "(exit)";
+}' > $SRC
+
+echo "interning $N symbols with $BIN"
+time $BIN $SRC
@@ -0,0 +1,14 @@
+;;; Allocation-heavy benchmark: repeatedly build and drop 10k element lists
+;;; usage: time build/microlisp ../bench/list.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons n acc))))
+(define (repeat k)
+  (if (= k 0)
+    'done
+    (begin
+      (build 10000 '())
+      (repeat (- k 1)))))
+(print (repeat 200))
+(exit)
@@ -0,0 +1,21 @@
+;;; Variable-heavy benchmark: nested lets and sum-of-squares from lib.scm
+;;; usage: time build/microlisp src/lib.scm ../bench/lookup.scm
+(define (nested n)
+  (let ((a n))
+    (let ((b (+ a 1)))
+      (let ((c (+ a b)))
+        (let ((d (+ b c)))
+          (+ a (+ b (+ c d))))))))
+(define (nested-loop i acc)
+  (if (= i 0)
+    acc
+    (nested-loop (- i 1) (+ acc (nested i)))))
+(print (nested-loop 100000 0))
+
+(define numbers (range 500))
+(define (squares-loop i acc)
+  (if (= i 0)
+    acc
+    (squares-loop (- i 1) (+ acc (sum-of-squares numbers)))))
+(print (squares-loop 200 0))
+(exit)
@@ -0,0 +1,30 @@
+;;; GC marking benchmark: keep a 100k element list and a 100k deep tree live
+;;; and force repeated collections over them
+;;; usage: time build/microlisp ../bench/mark.scm
+;;;        MICROLISP_GC_MARK_THREADS=4 build/microlisp ../bench/mark.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons n acc))))
+(define (nest n acc)
+  (if (= n 0)
+    acc
+    (nest (- n 1) (cons acc '()))))
+(define long-list (build 100000 '()))
+(define deep-tree (nest 100000 '()))
+(define (collect k)
+  (if (= k 0)
+    'done
+    (begin
+      (gc-pass)
+      (collect (- k 1)))))
+(define (sum list acc)
+  (if (null? list) acc (sum (cdr list) (+ acc (car list)))))
+(define (depth tree n)
+  (if (null? tree) n (depth (car tree) (+ n 1))))
+(print (collect 20))
+;;; what was live must come through the collections intact
+(print (if (= (sum long-list 0) 5000050000)
+         (if (= (depth deep-tree 0) 100000) 'intact 'tree-lost)
+         'list-lost))
+(exit)
@@ -0,0 +1,17 @@
+;;; GC pause benchmark: keep a large heap live while churning through short
+;;; lived lists, then report the longest collector pause in microseconds
+;;; usage: MICROLISP_GC_PAUSE_US=1000 build/microlisp ../bench/pause.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons n acc))))
+(define live (build 400000 '()))
+(define (churn k)
+  (if (= k 0)
+    'done
+    (begin
+      (build 10000 '())
+      (churn (- k 1)))))
+(churn 300)
+(print (gc-max-pause-us))
+(exit)
@@ -0,0 +1,22 @@
+;;; Primitive-heavy benchmark: arithmetic and list primitives in a loop, with
+;;; lib.scm loaded so the global environment is a realistic size
+;;; usage: time build/microlisp src/lib.scm ../bench/prims.scm
+(define cell (cons 3 4))
+(define (step i acc)
+  (if (= i 0)
+    acc
+    (step (- i 1)
+      (+ acc (* (car cell) (cdr cell)) (- (car cell) (cdr cell))))))
+(print (step 300000 0))
+
+(define (walk l n)
+  (if (null? l)
+    n
+    (walk (cdr l) (if (eq? (car l) 'x) (+ n 1) n))))
+(define xs (list 'x 'y 'x 'z 'x 'y 'x 'z))
+(define (walks i acc)
+  (if (= i 0)
+    acc
+    (walks (- i 1) (+ acc (walk xs 0)))))
+(print (walks 20000 0))
+(exit)
@@ -0,0 +1,24 @@
+;;; GC sweep benchmark: a large old generation of small vectors dies between
+;;; full collections, so each one leaves a lot of objects to release. Prints
+;;; the longest pause and the total pause time in microseconds
+;;; usage: MICROLISP_GC_PAUSE_US=0 MICROLISP_GC_BACKGROUND_SWEEP=1 \
+;;;        build/microlisp ../bench/sweep.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons (vector 2) acc))))
+(define keep '())
+(define (churn k)
+  (if (= k 0)
+    'done
+    (begin
+      (set! keep (build 200000 '()))
+      (churn (- k 1)))))
+(churn 20)
+(define (stat key alist)
+  (if (eq? key (car (car alist)))
+    (cdr (car alist))
+    (stat key (cdr alist))))
+(define stats (gc-stats))
+(print (list (stat 'max-pause-us stats) (stat 'total-pause-us stats)))
+(exit)
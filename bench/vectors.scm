@@ -0,0 +1,29 @@
+;;; Vector churn stress test: keeps a small table of large vectors live while
+;;; allocating, touching and dropping large and small vectors, then checks the
+;;; table survived. Max RSS should stay flat however many rounds are run
+;;; usage: build/microlisp ../bench/vectors.scm
+(define table (vector 8))
+;; write every 512th slot, so each page of the payload gets touched
+(define (touch v i n)
+  (if (> i n)
+    v
+    (begin
+      (vector-set v i i)
+      (touch v (+ i 512) n))))
+(define (smalls k)
+  (if (= k 0)
+    'done
+    (begin
+      (vector 4)
+      (smalls (- k 1)))))
+(define (churn k)
+  (if (= k 0)
+    'done
+    (begin
+      (vector-set table (- k (* 8 (/ k 8))) (touch (vector 100000) 0 99999))
+      (touch (vector 200000) 0 199999)
+      (smalls 200)
+      (churn (- k 1)))))
+(churn 400)
+(print (vector-get (vector-get table 3) 99840))
+(exit)
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Evaluator benchmark: runs each benchmark after lib.scm, tree walking and on
+# the bytecode VM (--vm), and prints the best wall time of a few runs of each.
+# usage: bench/vm.sh [path/to/microlisp] [benchmark.scm ...]
+BIN=${1:-scheme-gc/build/microlisp}
+shift
+DIR=$(dirname $0)
+LIB=$DIR/../scheme-gc/src/lib.scm
+[ $# -gt 0 ] || set -- $DIR/fib.scm $DIR/lookup.scm $DIR/prims.scm \
+	$DIR/frames.scm
+
+# best: prints the best wall time of 5 runs of the command, in milliseconds
+best() {
+	local i start t min=
+	for i in 1 2 3 4 5; do
+		start=$(date +%s%N)
+		"$@" < /dev/null > /dev/null
+		t=$((($(date +%s%N) - start) / 1000000))
+		[ -z "$min" ] || [ $t -lt $min ] && min=$t
+	done
+	echo ${min}ms
+}
+
+for f in "$@"; do
+	echo "$(basename $f): tree $(best $BIN $LIB $f), vm $(best $BIN --vm $LIB $f)"
+done
@@ -0,0 +1,18 @@
+;;; List walking benchmark: build a 1M element list, keep it live and walk it
+;;; end to end 10 times
+;;; usage: time build/microlisp ../bench/walk.scm
+(define (build n acc)
+  (if (= n 0)
+    acc
+    (build (- n 1) (cons n acc))))
+(define (walk l n)
+  (if (null? l)
+    n
+    (walk (cdr l) (+ n 1))))
+(define (repeat k total)
+  (if (= k 0)
+    total
+    (repeat (- k 1) (+ total (walk big 0)))))
+(define big (build 1000000 '()))
+(print (repeat 10 0))
+(exit)
@@ -45,6 +45,12 @@
       (car list)
       (assoc key (cdr list)))))
 
+;;; Call (proc key value) on every entry of a hash table
+(define (hash-table-walk table proc)
+  (map (lambda (entry) (proc (car entry) (cdr entry)))
+    (hash-table->alist table))
+  'ok)
+
 ;;; Lambda key-list with dispatch
 (define (make-key-list)
   (let ((list '())) 
@@ -27,12 +27,19 @@ SOFTWARE.
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define null(x) ((x) == NULL || (x) == NIL)
@@ -50,11 +57,27 @@ SOFTWARE.
 #define cadar(x) (car(cdr(car((x)))))
 #define cddr(x) (cdr(cdr((x))))
 #define cdadr(x) (cdr(car(cdr((x)))))
-#define atom(x) (!null(x) && (x)->type != LIST)
+#define atom(x) (!null(x) && type_of(x) != LIST)
 #define ASSERT_TYPE(x, t) (__type_check(__func__, x, t))
 
-typedef enum { INTEGER, SYMBOL, STRING, LIST, PRIMITIVE, VECTOR } type_t;
-typedef struct object *(*primitive_t)(void *, struct object *);
+typedef enum {
+    INTEGER,
+    SYMBOL,
+    STRING,
+    LIST,
+    PRIMITIVE,
+    VECTOR,
+    HASHTABLE
+} type_t;
+static char *TYPE_NAMES[] = {"integer",   "symbol", "string",   "list",
+                             "primitive", "vector", "hashtable"};
+typedef struct object *(*primitive_t)(struct object *);
+
+struct table_entry {
+    struct object *key;
+    struct object *value;
+    uint32_t hash; // of the key, never 0 except in free slots
+};
 
 /* Lisp object. We want to mimic the homoiconicity of LISP, so we will not be
    providing separate "types" for procedures, etc. Everything is represented as
@@ -62,24 +85,49 @@ typedef struct object *(*primitive_t)(void *, struct object *);
    primitive functions */
 
 struct object {
-    char gc;
-    type_t type;
-    bool mark;
-    struct object *gc_next;
     union {
         int64_t integer;
-        char *string;
+        struct {
+            char *string;
+            union {
+                struct {
+                    uint32_t hash; // SYMBOL: computed once when interned
+                    uint32_t form; // SYMBOL: its special_form, if any
+                };
+                size_t length; // STRING: bytes, excluding the terminator
+            };
+        };
         struct {
             struct object **vector;
             int vsize;
         };
+        struct {
+            struct table_entry *entries; // HASHTABLE: open addressed
+            uint32_t capacity;           // a power of two
+            uint32_t count : 31;
+            uint32_t equal : 1; // keyed by equal? rather than eq?
+        };
         struct {
             struct object *car;
             struct object *cdr;
         };
         primitive_t primitive;
     };
-} __attribute__((packed));
+    type_t type; // pairs stop short of this, their slab knows their type
+};
+
+/* Small integers are stored in the pointer itself, shifted left with the low
+   bit set. Objects come out of the slabs 8 byte aligned, so a real pointer
+   never has that bit set. Anything that may be handed an integer has to go
+   through type_of and integer_value instead of looking inside the object */
+#define is_fixnum(x) ((uintptr_t)(x)&1)
+#define make_fixnum(n) ((struct object *)(((uintptr_t)(n) << 1) | 1))
+#define FIXNUM_MAX (INT64_MAX >> 1)
+#define FIXNUM_MIN (INT64_MIN >> 1)
+
+static inline int64_t integer_value(struct object *x) {
+    return is_fixnum(x) ? (int64_t)(intptr_t)x >> 1 : x->integer;
+}
 
 /* We declare a couple of global variables for keywords */
 static struct object *ENV = NULL;
@@ -95,61 +143,167 @@ static struct object *IF = NULL;
 static struct object *LAMBDA = NULL;
 static struct object *BEGIN = NULL;
 static struct object *PROCEDURE = NULL;
+static struct object *OR = NULL;
+static struct object *COND = NULL;
+static struct object *ELSE = NULL;
+/* what eval does with a list starting with the symbol of one, which is tagged
+   with it when interned at start up */
+enum special_form {
+    NOT_SPECIAL,
+    FORM_QUOTE,
+    FORM_LAMBDA,
+    FORM_DEFINE,
+    FORM_SET,
+    FORM_LET,
+    FORM_BEGIN,
+    FORM_IF,
+    FORM_OR,
+    FORM_COND
+};
+/* the global frame, whose bindings are also kept in GLOBALS: a hash table from
+   each name to the cell holding its value, so that looking one up need not go
+   through every name defined so far */
+static struct object *GLOBAL_FRAME = NULL;
+static struct object *GLOBALS = NULL;
+/* the value of a name a body defines until its definition has run, and in the
+   cell of a global referred to before it is defined, which is kept in GLOBALS
+   alone until it is. Its name cannot be read either */
+static struct object *UNBOUND = NULL;
 
 void print_exp(char *, struct object *);
 bool is_tagged(struct object *cell, struct object *tag);
-struct object *read_exp(void *, FILE *in);
-struct object *eval(void *, struct object *exp, struct object *env);
-struct object *cons(void *, struct object *x, struct object *y);
-struct object *load_file(void *, struct object *args);
+struct object *read_exp(FILE *in);
+struct object *eval(struct object *exp, struct object *env);
+struct object *cons(struct object *x, struct object *y);
+struct object *load_file(struct object *args);
 struct object *cdr(struct object *);
 struct object *car(struct object *);
 struct object *lookup_variable(struct object *var, struct object *env);
-struct object *make_symbol(void *, char *);
+struct object *make_symbol(char *);
 
 /*==============================================================================
   Hash table for saving Lisp symbol objects. Conserves memory and faster
   compares
   ==============================================================================*/
+/* Open addressing (Robin Hood) table. Each slot caches the full hash of its
+   key, so probes only fall back to strcmp when the hashes match. Entries that
+   are further from their home slot steal the position of entries that are
+   closer to theirs, which keeps probe sequences short even at high load */
 struct htable {
     struct object *key;
+    uint32_t hash;
 };
-/* One dimensional hash table */
 static struct htable *HTABLE = NULL;
-static int HTABLE_SIZE;
+static size_t HTABLE_SIZE; // always a power of two
+static size_t HTABLE_COUNT;
 
-static uint64_t hash(const char *s) {
-    uint64_t h = 0;
+#define HT_MAX_LOAD(size) (((size) >> 2) * 3) // resize past 75% full
+#define HT_DIST(h, pos) (((pos) - ((h) & (HTABLE_SIZE - 1))) & (HTABLE_SIZE - 1))
+
+/* FNV-1a */
+static uint32_t hash(const char *s) {
+    uint32_t h = 2166136261u;
     uint8_t *u = (uint8_t *)s;
     while (*u) {
-        h = (h * 256 + *u) % HTABLE_SIZE;
-        u++;
+        h ^= *u++;
+        h *= 16777619u;
     }
     return h;
 }
 
-int ht_init(int size) {
-    if (HTABLE || !(size % 2))
-        error("Hash table already initialized or even # of entries");
-    HTABLE = malloc(sizeof(struct htable) * size);
-    memset(HTABLE, 0, sizeof(struct htable) * size);
+size_t ht_init(size_t size) {
+    if (HTABLE || !size || (size & (size - 1)))
+        error("Hash table already initialized or size not a power of two");
+    HTABLE = calloc(size, sizeof(struct htable));
     HTABLE_SIZE = size;
+    HTABLE_COUNT = 0;
     return size;
 }
 
+static void ht_place(struct object *key, uint32_t h) {
+    size_t pos = h & (HTABLE_SIZE - 1);
+    size_t dist = 0;
+    for (;;) {
+        if (HTABLE[pos].key == NULL) {
+            HTABLE[pos].key = key;
+            HTABLE[pos].hash = h;
+            return;
+        }
+        size_t existing = HT_DIST(HTABLE[pos].hash, pos);
+        if (existing < dist) {
+            struct htable tmp = HTABLE[pos];
+            HTABLE[pos].key = key;
+            HTABLE[pos].hash = h;
+            key = tmp.key;
+            h = tmp.hash;
+            dist = existing;
+        }
+        pos = (pos + 1) & (HTABLE_SIZE - 1);
+        dist++;
+    }
+}
+
+static void ht_resize(size_t size) {
+    struct htable *old = HTABLE;
+    size_t old_size = HTABLE_SIZE;
+    size_t i;
+    HTABLE = calloc(size, sizeof(struct htable));
+    if (HTABLE == NULL)
+        error("Out of memory growing symbol table");
+    HTABLE_SIZE = size;
+    for (i = 0; i < old_size; i++)
+        if (old[i].key)
+            ht_place(old[i].key, old[i].hash);
+    free(old);
+}
+
 void ht_insert(struct object *key) {
-    uint64_t h = hash(key->string);
-    HTABLE[h].key = key;
+    if (HTABLE_COUNT + 1 > HT_MAX_LOAD(HTABLE_SIZE))
+        ht_resize(HTABLE_SIZE << 1);
+    ht_place(key, key->hash);
+    HTABLE_COUNT++;
+}
+
+/* Returns the slot holding s, or -1 if it is not present. Robin Hood ordering
+   lets us stop as soon as we pass an entry closer to home than we are */
+static ssize_t ht_find(const char *s, uint32_t h) {
+    size_t pos = h & (HTABLE_SIZE - 1);
+    size_t dist = 0;
+    while (HTABLE[pos].key != NULL && dist <= HT_DIST(HTABLE[pos].hash, pos)) {
+        if (HTABLE[pos].hash == h && !strcmp(HTABLE[pos].key->string, s))
+            return pos;
+        pos = (pos + 1) & (HTABLE_SIZE - 1);
+        dist++;
+    }
+    return -1;
 }
 
+/* Remove key, shifting the following entries of the cluster back one slot so
+   that no tombstones are needed */
 void ht_delete(struct object *key) {
-    uint64_t h = hash(key->string);
-    HTABLE[h].key = 0;
+    uint32_t h = key->hash;
+    size_t pos = h & (HTABLE_SIZE - 1);
+    size_t dist = 0;
+    while (HTABLE[pos].key != key) {
+        if (HTABLE[pos].key == NULL || dist > HT_DIST(HTABLE[pos].hash, pos))
+            return;
+        pos = (pos + 1) & (HTABLE_SIZE - 1);
+        dist++;
+    }
+    for (;;) {
+        size_t next = (pos + 1) & (HTABLE_SIZE - 1);
+        if (HTABLE[next].key == NULL || HT_DIST(HTABLE[next].hash, next) == 0)
+            break;
+        HTABLE[pos] = HTABLE[next];
+        pos = next;
+    }
+    HTABLE[pos].key = NULL;
+    HTABLE_COUNT--;
 }
 
-struct object *ht_lookup(char *s) {
-    uint64_t h = hash(s);
-    return HTABLE[h].key;
+struct object *ht_lookup(char *s, uint32_t h) {
+    ssize_t pos = ht_find(s, h);
+    return (pos < 0) ? NULL : HTABLE[pos].key;
 }
 
 /*==============================================================================
@@ -157,190 +311,1329 @@ struct object *ht_lookup(char *s) {
   Garbage collection implemented by @nitros12 https://github.com/nitros12
   ==============================================================================*/
 
-/* Store working object pointers in the stack.
- * each stack will hold reference to parent workspaces, up to this root on here
- * workspace will always end with a 1 pointer followed by the start address of
- * the next workspace.
+/* Precise roots: a shadow stack holding the address of every local variable
+ * that keeps an object alive across an allocation. gc_frame() remembers the
+ * height of the stack, and the cleanup attribute puts it back whenever the
+ * enclosing scope is left, however that happens. gc_root(var) registers a
+ * variable, and must only be used on variables that stay in scope for the rest
+ * of the frame, once each.
  */
-void *workspace_base[2] = {(void *)1, NULL};
+static struct object ***ROOTS = NULL;
+static size_t roots_top = 0;
+static size_t roots_size = 0;
+
+void grow_roots(void) {
+    roots_size = roots_size ? roots_size << 1 : 1024;
+    ROOTS = realloc(ROOTS, sizeof(struct object **) * roots_size);
+    if (ROOTS == NULL)
+        error("Out of memory growing root stack");
+}
+
+/* the bytecode VM's stack, its first vm_sp entries are roots as well */
+static struct object **VM_STACK = NULL;
+static size_t vm_sp = 0;
+static size_t vm_size = 0;
 
-/* create a workspace, set 1 pointer and set up workspace_root*/
-#define create_workspace(size)                                                 \
-    void *workspace_ARRAY[size + 2] = {0};                                     \
-    workspace_ARRAY[size] = (void *)1;                                         \
-    workspace_ARRAY[size + 1] = workspace;                                     \
-    workspace = workspace_ARRAY;
+void grow_vm_stack(void) {
+    vm_size = vm_size ? vm_size << 1 : 1024;
+    VM_STACK = realloc(VM_STACK, sizeof(struct object *) * vm_size);
+    if (VM_STACK == NULL)
+        error("Out of memory growing VM stack");
+}
+
+static inline void gc_unwind(size_t *top) { roots_top = *top; }
 
-#define set_local(pos, var) (((struct object ***)workspace)[pos] = &var)
+#define gc_frame()                                                             \
+    size_t gc_frame_top __attribute__((cleanup(gc_unwind))) = roots_top
+
+#define gc_root(var)                                                           \
+    do {                                                                       \
+        if (roots_top == roots_size)                                           \
+            grow_roots();                                                      \
+        ROOTS[roots_top++] = &(var);                                           \
+    } while (0)
 
 size_t gc_total_alloc = 0; // total objects allocated over the runtime of the interpreter
 size_t gc_objects_used = 0; // total objects currently in use
 size_t gc_pool_size = 0; // total objects in pool
 // current objects currently allocated = gc_pool_size + gc_objects_used
+size_t gc_young_bytes = 0; // bytes allocated since the last collection
+size_t gc_old_bytes = 0; // bytes of objects that have survived a collection
+uint64_t gc_max_pause_us = 0; // longest time spent in the collector at once
+
+/* Everything else worth knowing when tuning the collector, all of it counted
+   as it happens. Pauses are bucketed by log2 of their length: bucket 0 holds
+   pauses under 1us, bucket i those under 2^i us, and the last bucket whatever
+   is left over */
+#define GC_PAUSE_BUCKETS 16
+struct gc_stats {
+    size_t minor; // nursery collections
+    size_t full;  // full collections run to completion
+    size_t pauses;
+    uint64_t total_pause_us;
+    size_t pause_histogram[GC_PAUSE_BUCKETS];
+    size_t freed[HASHTABLE + 1]; // objects released, by type
+    size_t vector_bytes;         // held by the payloads of live vectors
+    size_t table_bytes;          // held by the entries of live hash tables
+    size_t large_bytes;          // of which in the large object space
+    size_t string_bytes;         // held by the buffers of live strings
+    size_t slabs_allocated;
+    size_t slabs_freed;
+};
+static struct gc_stats GC_STATS;
+static size_t gc_stats_every = 0; // dump the stats every so many collections
+
+/* Objects are carved out of large slabs aligned to their own size, so the slab
+   owning an object can be found by masking its address. Pairs get slabs of
+   their own, where each cell is just the car and the cdr, and the slab says
+   what type they are. Everything else lives in object slabs with the type
+   stored after the payload. Rather than keeping anything else in the object,
+   each slab has side bitmaps with one bit per cell: `live` for allocated
+   cells, `marks` for marked ones and `remembered` for the remembered set.
+
+   Mark bits are sticky, and double as the generation: a marked object is old,
+   an unmarked one was allocated since the last collection. A minor collection
+   leaves the marks alone and only has to mark the young survivors, while a
+   full collection clears every mark first.
+
+   Sweeping is lazy. A collection just bumps gc_epoch, and a slab is swept
+   the next time it is allocated from: anything live but unmarked is dead. The
+   bitmaps make that a few word operations per slab, so the cost of sweeping
+   follows the allocation rate and dead objects are only touched when they need
+   finalizing. Objects are never moved, since C code keeps raw object pointers
+   outside the root stack.
+
+   An old object pointing at a young one would hide that object from a minor
+   collection, so every store into an existing object has to go through
+   gc_write_barrier, which records the old object in the remembered set */
+#define SLAB_SIZE (64 * 1024)
+#define PAIR_SIZE (2 * sizeof(struct object *))
+#define SLAB_WORDS (SLAB_SIZE / PAIR_SIZE / 64)
+#define cell_size(kind)                                                        \
+    ((kind) == PAIR_SLAB ? PAIR_SIZE : sizeof(struct object))
+#define SLAB_CELLS(kind) ((SLAB_SIZE - sizeof(struct slab)) / cell_size(kind))
+#define slab_of(obj)                                                           \
+    ((struct slab *)((uintptr_t)(obj) & ~(uintptr_t)(SLAB_SIZE - 1)))
+#define cell_at(slab, i)                                                       \
+    ((struct object *)((slab)->cells + (i)*cell_size((slab)->kind)))
+#define bit_of(i) ((uint64_t)1 << ((i) % 64))
+
+enum slab_kind { OBJECT_SLAB, PAIR_SLAB };
 
-static struct object *GC_HEAD = NULL;
-static struct object *GC_POOL_HEAD = NULL;
+struct slab {
+    struct slab *next;
+    enum slab_kind kind;
+    unsigned epoch; // swept since the last collection if equal to gc_epoch
+    size_t free;    // cells without a live bit
+    size_t cursor;  // every word of live before this one is full
+    uint64_t live[SLAB_WORDS];
+    uint64_t marks[SLAB_WORDS];
+    uint64_t remembered[SLAB_WORDS];
+    char cells[] __attribute__((aligned(64)));
+};
+
+/* Pair slabs are all carved out of one stretch of address space reserved up
+   front, so telling a pair from any other object is a range check on the
+   pointer rather than a load from its slab */
+#define PAIR_SPACE_SIZE ((uintptr_t)1 << 36)
+static char *PAIR_SPACE = NULL;
+static size_t pair_space_used = 0;
+/* pair slabs handed back by shrink_pool, ready for reuse */
+static struct slab *FREE_PAIR_SLABS = NULL;
+
+#define is_pair(x)                                                             \
+    (!is_fixnum(x) && (uintptr_t)(x) - (uintptr_t)PAIR_SPACE < PAIR_SPACE_SIZE)
+
+static inline type_t type_of(struct object *x) {
+    if (is_fixnum(x))
+        return INTEGER;
+    return is_pair(x) ? LIST : x->type;
+}
+
+static struct slab *SLABS = NULL;
+/* Every slab of the kind before its ALLOC_SLAB in the SLABS list is swept and
+   full */
+static struct slab *ALLOC_SLAB[2] = {NULL, NULL};
+static size_t POOL_CELLS[2] = {0, 0};
+static unsigned gc_epoch = 0;
+
+/* Full collections are incremental. Marking starts from the roots and is then
+   advanced a slice at a time from alloc, each slice bounded by the pause
+   budget. Objects allocated while marking are born grey, and the write barrier
+   shades every pointer stored into the heap, so a marked object never ends up
+   pointing at an unmarked one. Once the grey stack runs dry the roots are
+   rescanned, since stores to locals have no barrier, and the slices go on to
+   sweep whatever slabs alloc has not got round to */
+enum gc_phase { GC_IDLE, GC_MARKING, GC_SWEEPING };
+static enum gc_phase GC_PHASE = GC_IDLE;
+static struct slab *SWEEP_SLAB = NULL;
+
+/* microseconds of collector work per slice, 0 collects in one go */
+static uint64_t gc_pause_budget_us = 1000;
+/* run a slice of an ongoing collection every this many allocations */
+#define GC_SLICE_ALLOCS 256
+static int gc_slice_countdown = GC_SLICE_ALLOCS;
 
-int gc_pass(void *);
-void mark_object(struct object *);
-void grow_pool(size_t);
+/* Heap sizing. Collections are paced by bytes allocated, counting the cells
+   as well as what vectors and strings hold outside the pool. A minor
+   collection runs once the nursery has taken gc_nursery_bytes, and a full one
+   once the old generation outgrows what survived the last full collection so
+   far that the survivors would only make up gc_target_live_pct of it.
+
+   The pool grows whenever alloc runs dry. After a full collection it is sized
+   against the most the triggers have let the heap reach over the last
+   GC_SIZING_WINDOW full collections, and only trimmed once it is more than
+   gc_shrink_slack_pct over that. Until the heap kept that way fills up there
+   is no full collection either. A live set that comes and goes keeps its slabs
+   rather than trading them back and forth with malloc, while one that has
+   really shrunk gives them back a few collections later */
+static size_t gc_nursery_bytes = 1024 * 1024;
+static size_t gc_target_live_pct = 50;
+static size_t gc_shrink_slack_pct = 100;
+/* full collection once the old generation outgrows this */
+static size_t gc_old_limit = 1024 * 1024;
+#define GC_SIZING_WINDOW 8
+static size_t gc_heap_needs[GC_SIZING_WINDOW]; // in slabs, by full collection
+
+/* Growable array of object pointers */
+struct object_stack {
+    struct object **items;
+    size_t size;
+    size_t top;
+};
+
+/* Objects that have been marked but whose children have not been visited yet.
+   Marking runs off this stack rather than the C stack, so arbitrarily long
+   lists and deep trees can be marked without overflowing it */
+static struct object_stack MARK_STACK = {NULL, 0, 0};
+/* Old objects that have had a pointer to a young object stored into them */
+static struct object_stack REMEMBERED = {NULL, 0, 0};
+
+int gc_pass(void);
+void gc_dump_stats(FILE *);
+void grow_pool(enum slab_kind, size_t);
 void shrink_pool(size_t);
+void mark_push(struct object *);
 
-void push_object(struct object **head, struct object *obj) {
-    obj->gc_next = *head;
-    *head = obj;
+uint64_t gc_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-struct object *pop_object(struct object **head) {
-    if (*head == NULL)
-        return NULL;
-    struct object *ret = *head;
-    *head = (*head)->gc_next;
-    return ret;
+void gc_record_pause(uint64_t start) {
+    uint64_t pause = gc_now_us() - start;
+    int bucket = pause ? 64 - __builtin_clzll(pause) : 0;
+    if (pause > gc_max_pause_us)
+        gc_max_pause_us = pause;
+    if (bucket >= GC_PAUSE_BUCKETS)
+        bucket = GC_PAUSE_BUCKETS - 1;
+    GC_STATS.pauses++;
+    GC_STATS.total_pause_us += pause;
+    GC_STATS.pause_histogram[bucket]++;
+}
+
+/* count a finished collection of either kind */
+void gc_record_collection(size_t *counter) {
+    (*counter)++;
+    if (gc_stats_every &&
+        (GC_STATS.minor + GC_STATS.full) % gc_stats_every == 0)
+        gc_dump_stats(stderr);
+}
+
+void stack_push(struct object_stack *stack, struct object *obj) {
+    if (stack->top == stack->size) {
+        stack->size = stack->size ? stack->size << 1 : 1024;
+        stack->items =
+            realloc(stack->items, sizeof(struct object *) * stack->size);
+        if (stack->items == NULL)
+            error("Out of memory growing GC stack");
+    }
+    stack->items[stack->top++] = obj;
+}
+
+/* position of an object's bits in the bitmaps of its slab */
+size_t cell_index(struct slab *slab, struct object *obj) {
+    size_t offset = (char *)obj - slab->cells;
+    if (slab->kind == PAIR_SLAB)
+        return offset / PAIR_SIZE;
+    return offset / sizeof(struct object);
+}
+
+/* what an object counts for in the old generation, including what it holds
+   outside the pool */
+static inline size_t object_bytes(struct slab *slab, struct object *obj) {
+    if (slab->kind == PAIR_SLAB)
+        return PAIR_SIZE;
+    if (obj->type == VECTOR)
+        return sizeof(struct object) + sizeof(struct object *) * obj->vsize;
+    if (obj->type == HASHTABLE)
+        return sizeof(struct object) +
+               sizeof(struct table_entry) * obj->capacity;
+    if (obj->type == STRING)
+        return sizeof(struct object) + obj->length + 1;
+    return sizeof(struct object);
+}
+
+bool is_marked(struct object *obj) {
+    struct slab *slab = slab_of(obj);
+    size_t i = cell_index(slab, obj);
+    return slab->marks[i / 64] & bit_of(i);
+}
+
+/* set the mark bit, returns false if it was already set */
+bool set_mark(struct object *obj) {
+    struct slab *slab = slab_of(obj);
+    size_t i = cell_index(slab, obj);
+    if (slab->marks[i / 64] & bit_of(i))
+        return false;
+    slab->marks[i / 64] |= bit_of(i);
+    gc_old_bytes += object_bytes(slab, obj);
+    return true;
+}
+
+void gc_write_barrier(struct object *obj, struct object *val) {
+    if (null(val) || is_fixnum(val))
+        return;
+    if (GC_PHASE == GC_MARKING) {
+        mark_push(val);
+        return;
+    }
+    struct slab *slab = slab_of(obj);
+    size_t i = cell_index(slab, obj);
+    if ((slab->marks[i / 64] & ~slab->remembered[i / 64] & bit_of(i)) &&
+        !is_marked(val)) {
+        slab->remembered[i / 64] |= bit_of(i);
+        stack_push(&REMEMBERED, obj);
+    }
+}
+
+/* The symbol table is shared with the background sweeper */
+static pthread_mutex_t HTABLE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+void collect_hashed(struct object *obj) {
+    pthread_mutex_lock(&HTABLE_LOCK);
+    ht_delete(obj);
+    pthread_mutex_unlock(&HTABLE_LOCK);
+    free(obj->string);
+}
+
+void debug_gc(struct object *obj) {
+    char *types[7] = {"INTEGER",   "SYMBOL", "STRING",   "LIST",
+                      "PRIMITIVE", "VECTOR", "HASHTABLE"};
+    printf("\nCollecting object at %p, of type %s, value: ", (void *)obj,
+           types[type_of(obj)]);
+    print_exp(NULL, obj);
+    putchar('\n');
+}
+
+/* Vector payloads and hash table entries belong to their owner. Small ones come
+   from malloc and are freed when the owner is swept. Payloads of
+   LARGE_OBJECT_SIZE or more go in the large object space instead: each gets
+   pages of its own straight from mmap, which come zeroed and never move, and
+   is kept on a list with its owner. As soon as a collection has finished
+   marking, the list is walked and the pages of unmarked owners go back to the
+   system, without waiting for alloc or the sweeper to get round to the owner's
+   slab */
+#define LARGE_OBJECT_SIZE (32 * 1024)
+
+struct large_object {
+    struct large_object *next;
+    struct object *owner;
+    size_t size; // of the mapping, header included
+    struct object *items[];
+};
+
+static struct large_object *LARGE_OBJECTS = NULL;
+
+void *alloc_payload(struct object *owner, size_t bytes) {
+    if (bytes < LARGE_OBJECT_SIZE) {
+        void *items = calloc(1, bytes ? bytes : 1);
+        if (items == NULL)
+            error("Out of memory allocating payload");
+        return items;
+    }
+    size_t size = sizeof(struct large_object) + bytes;
+    struct large_object *large = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (large == MAP_FAILED)
+        error("Out of memory allocating payload");
+    large->next = LARGE_OBJECTS;
+    large->owner = owner;
+    large->size = size;
+    LARGE_OBJECTS = large;
+    GC_STATS.large_bytes += bytes;
+    return large->items;
+}
+
+/* give back a payload its owner has outgrown, while the owner lives on */
+void free_payload(void *items, size_t bytes) {
+    if (bytes < LARGE_OBJECT_SIZE) {
+        free(items);
+        return;
+    }
+    struct large_object **link = &LARGE_OBJECTS;
+    while ((*link)->items != items)
+        link = &(*link)->next;
+    struct large_object *large = *link;
+    *link = large->next;
+    GC_STATS.large_bytes -= bytes;
+    munmap(large, large->size);
+}
+
+/* release the large payloads of owners that did not get marked, the marks
+   have to be complete */
+void sweep_large_objects(void) {
+    struct large_object **link = &LARGE_OBJECTS;
+    while (*link != NULL) {
+        struct large_object *large = *link;
+        struct object *owner = large->owner;
+        if (is_marked(owner)) {
+            link = &large->next;
+            continue;
+        }
+        *link = large->next;
+        GC_STATS.large_bytes -= large->size - sizeof(struct large_object);
+        if (owner->type == HASHTABLE) {
+            GC_STATS.table_bytes -= large->size - sizeof(struct large_object);
+            owner->entries = NULL;
+            owner->capacity = 0;
+        } else {
+            GC_STATS.vector_bytes -= large->size - sizeof(struct large_object);
+            owner->vector = NULL;
+            owner->vsize = 0;
+        }
+        munmap(large, large->size);
+    }
+}
+
+/* free whatever a dead object owns outside the pool, counting it in stats */
+void release_object(struct object *obj, struct gc_stats *stats) {
+#ifdef DEBUG_GC
+    debug_gc(obj);
+#endif
+    stats->freed[obj->type]++;
+    if (obj->type == SYMBOL) {
+        collect_hashed(obj);
+    } else if (obj->type == STRING) {
+        stats->string_bytes -= obj->length + 1;
+        free(obj->string);
+    } else if (obj->type == VECTOR) {
+        stats->vector_bytes -= sizeof(struct object *) * obj->vsize;
+        free(obj->vector); // large payloads are gone already
+    } else if (obj->type == HASHTABLE) {
+        stats->table_bytes -= sizeof(struct table_entry) * obj->capacity;
+        free(obj->entries);
+    }
+}
+
+/* Release the cells that are live but unmarked, returns how many there were.
+   Only the survivors are left live, so free cells are found straight from the
+   bitmap. Pairs own nothing, so dead pairs are never even touched. The slab
+   only reads as swept once all of that is done */
+size_t sweep_slab(struct slab *slab, struct gc_stats *stats) {
+    size_t w, freed = 0;
+    for (w = 0; w < SLAB_WORDS; w++) {
+        uint64_t dead = slab->live[w] & ~slab->marks[w];
+        freed += __builtin_popcountll(dead);
+        for (; dead && slab->kind == OBJECT_SLAB; dead &= dead - 1)
+            release_object(cell_at(slab, w * 64 + __builtin_ctzll(dead)),
+                           stats);
+        slab->live[w] = slab->marks[w];
+    }
+    if (slab->kind == PAIR_SLAB)
+        stats->freed[LIST] += freed;
+    slab->free += freed;
+    slab->cursor = 0;
+    __atomic_store_n(&slab->epoch, gc_epoch, __ATOMIC_RELEASE);
+    return freed;
+}
+
+#define slab_swept(slab)                                                       \
+    (__atomic_load_n(&(slab)->epoch, __ATOMIC_ACQUIRE) == gc_epoch)
+
+/* Background sweeping. The sweep that follows a full collection can be left
+   to a thread of its own, while alloc carries on out of whatever slabs have
+   been swept already, sweeping any it gets to first itself. Whoever sweeps a
+   slab claims it first by swapping its epoch for SLAB_BUSY, so each is swept
+   exactly once, and alloc just passes over the ones the sweeper is busy with.
+   The sweeper keeps counts of its own, folded back in when it is joined.
+   Anything that needs the whole heap swept or the epoch moved on joins it
+   first, which is also the only time alloc ever waits on it */
+#define SLAB_BUSY UINT_MAX
+static size_t gc_background_sweep = 0;
+static pthread_t SWEEPER;
+static bool sweeper_running = false;
+static bool sweeper_done;
+static size_t sweeper_freed;
+static struct gc_stats SWEEPER_STATS;
+
+/* Symbols can be unhashed by the sweeper, but the mutator has the table to
+   itself otherwise, and is the one that starts and joins the sweeper */
+void lock_symbols(void) {
+    if (sweeper_running)
+        pthread_mutex_lock(&HTABLE_LOCK);
+}
+
+void unlock_symbols(void) {
+    if (sweeper_running)
+        pthread_mutex_unlock(&HTABLE_LOCK);
+}
+
+/* claim an unswept slab for sweeping, false if it is swept or taken */
+bool claim_slab(struct slab *slab) {
+    unsigned epoch = __atomic_load_n(&slab->epoch, __ATOMIC_ACQUIRE);
+    if (epoch == gc_epoch || epoch == SLAB_BUSY)
+        return false;
+    return __atomic_compare_exchange_n(&slab->epoch, &epoch, SLAB_BUSY, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void *sweeper_main(void *arg) {
+    struct slab *slab;
+    for (slab = arg; slab != NULL; slab = slab->next)
+        if (claim_slab(slab))
+            sweeper_freed += sweep_slab(slab, &SWEEPER_STATS);
+    __atomic_store_n(&sweeper_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* sweep the slabs SLABS had in it at the time, unless a thread is not to be
+   had, in which case sweeping is left to the slices and to alloc */
+void start_sweeper(void) {
+    sweeper_done = false;
+    sweeper_running = !pthread_create(&SWEEPER, NULL, sweeper_main, SLABS);
+}
+
+/* wait for the sweeper, returns how many objects it freed */
+size_t join_sweeper(void) {
+    size_t freed;
+    int i;
+    if (!sweeper_running)
+        return 0;
+    pthread_join(SWEEPER, NULL);
+    freed = sweeper_freed;
+    sweeper_running = false;
+    gc_objects_used -= freed;
+    sweeper_freed = 0;
+    for (i = 0; i <= HASHTABLE; i++)
+        GC_STATS.freed[i] += SWEEPER_STATS.freed[i];
+    GC_STATS.string_bytes += SWEEPER_STATS.string_bytes;
+    GC_STATS.vector_bytes += SWEEPER_STATS.vector_bytes;
+    GC_STATS.table_bytes += SWEEPER_STATS.table_bytes;
+    GC_STATS.large_bytes += SWEEPER_STATS.large_bytes;
+    memset(&SWEEPER_STATS, 0, sizeof(SWEEPER_STATS));
+    return freed;
+}
+
+/* sweep whatever the sweeper has not got to yet alongside it */
+size_t sweep_all(void) {
+    struct slab *slab;
+    size_t freed = 0;
+    for (slab = SLABS; slab != NULL; slab = slab->next)
+        if (claim_slab(slab))
+            freed += sweep_slab(slab, &GC_STATS);
+    gc_objects_used -= freed;
+    return freed + join_sweeper();
+}
+
+/* Every slab is left to be swept again after a collection */
+void gc_new_epoch(void) {
+    gc_epoch++;
+    ALLOC_SLAB[OBJECT_SLAB] = ALLOC_SLAB[PAIR_SLAB] = SLABS;
+}
+
+void gc_minor(void);
+void gc_start(void);
+void gc_step(void);
+void gc_finish_marking(void);
+
+/* Collect the nursery, starting a full collection once the old generation has
+   outgrown its limit. Marking shares the mark bits with minor collections, so
+   the nursery is left to grow while a full collection is marking and the
+   marking is finished outright if it falls too far behind. Sweeping is no
+   obstacle, the dead objects it has yet to reach are unmarked either way */
+void gc_collect(void) {
+    if (GC_PHASE == GC_MARKING && gc_young_bytes < gc_nursery_bytes << 1)
+        return; // let the slices catch up before forcing the issue
+    uint64_t start = gc_now_us();
+    if (GC_PHASE == GC_MARKING)
+        gc_finish_marking();
+    if (gc_young_bytes >= gc_nursery_bytes)
+        gc_minor();
+    gc_record_pause(start);
+    if (GC_PHASE == GC_IDLE && gc_old_bytes > gc_old_limit) {
+        start = gc_now_us();
+        if (gc_pause_budget_us) {
+            gc_start();
+        } else if (gc_background_sweep) {
+            gc_start(); // all but the sweep in one go
+            gc_finish_marking();
+        } else {
+            gc_pass();
+            return;
+        }
+        gc_record_pause(start);
+    }
 }
 
-void gc_pool_maintain(void *workspace) {
+/* Collections are paced by allocation rather than by the size of the pool,
+   which alloc grows whenever it runs out of free objects */
+void gc_pool_maintain(void) {
 #ifdef FORCE_GC
-    gc_pass(workspace);
+    gc_pass();
 #else
-    if (gc_pool_size == gc_objects_used)
-        gc_pass(workspace);
+    if (GC_PHASE != GC_IDLE && --gc_slice_countdown == 0)
+        gc_step();
+    if (gc_young_bytes >= gc_nursery_bytes)
+        gc_collect();
 #endif
-    if (gc_pool_size == gc_objects_used)
-        grow_pool((gc_pool_size >> 1) + 1); // grow to 150%
-    else if (gc_objects_used < gc_pool_size >> 1) // shrink when we have more than 50% unused
-        shrink_pool(gc_pool_size >> 2); // trim off 25%
 }
 
-void grow_pool(size_t n) {
+struct slab *new_pair_slab(void) {
+    struct slab *slab = FREE_PAIR_SLABS;
+    if (slab != NULL) {
+        FREE_PAIR_SLABS = slab->next;
+        return slab;
+    }
+    if (PAIR_SPACE == NULL) {
+        /* reserve an extra slab so the start can be aligned */
+        char *base = mmap(NULL, PAIR_SPACE_SIZE + SLAB_SIZE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            error("Could not reserve address space for pairs");
+        PAIR_SPACE = (char *)slab_of(base + SLAB_SIZE - 1);
+    }
+    if (pair_space_used == PAIR_SPACE_SIZE)
+        error("Out of memory");
+    slab = (struct slab *)(PAIR_SPACE + pair_space_used);
+    if (mprotect(slab, SLAB_SIZE, PROT_READ | PROT_WRITE))
+        error("Out of memory");
+    pair_space_used += SLAB_SIZE;
+    return slab;
+}
+
+void free_slab(struct slab *slab) {
+    GC_STATS.slabs_freed++;
+    if (slab->kind == OBJECT_SLAB) {
+        free(slab);
+        return;
+    }
+    /* hand the pages back but keep the address range */
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+    slab->next = FREE_PAIR_SLABS;
+    FREE_PAIR_SLABS = slab;
+}
+
+void grow_pool(enum slab_kind kind, size_t n) {
+    size_t slabs = (n + SLAB_CELLS(kind) - 1) / SLAB_CELLS(kind);
 #ifdef DEBUG_POOL
-    printf("growing pool by %ld\n", n);
+    printf("growing pool by %ld\n", slabs * SLAB_CELLS(kind));
 #endif
-    gc_pool_size += n;
-    gc_total_alloc += n;
-    struct object *obj;
-    while (n--) {
-        obj = malloc(sizeof(struct object));
-        push_object(&GC_POOL_HEAD, obj);
+    gc_pool_size += slabs * SLAB_CELLS(kind);
+    POOL_CELLS[kind] += slabs * SLAB_CELLS(kind);
+    GC_STATS.slabs_allocated += slabs;
+    while (slabs--) {
+        struct slab *slab = kind == PAIR_SLAB
+                                ? new_pair_slab()
+                                : aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+        if (slab == NULL)
+            error("Out of memory");
+        memset(slab, 0, sizeof(struct slab));
+        slab->kind = kind;
+        slab->free = SLAB_CELLS(kind);
+        slab->epoch = gc_epoch;
+        slab->next = SLABS;
+        SLABS = slab;
     }
+    ALLOC_SLAB[kind] = SLABS;
 }
 
+/* Release completely empty slabs, up to n of them */
 void shrink_pool(size_t n) {
+    struct slab **link = &SLABS;
+    size_t released = 0;
+    while (*link != NULL && n) {
+        struct slab *slab = *link;
+        if (slab_swept(slab) && slab->free == SLAB_CELLS(slab->kind)) {
+            *link = slab->next;
+            released += slab->free;
+            n--;
+            POOL_CELLS[slab->kind] -= slab->free;
+            free_slab(slab);
+        } else {
+            link = &slab->next;
+        }
+    }
 #ifdef DEBUG_POOL
-    printf("shrinking pool by %ld\n", n);
+    printf("shrinking pool by %ld\n", released);
 #endif
-    gc_pool_size -= n;
-    while (n--) {
-        free(pop_object(&GC_POOL_HEAD));
+    gc_pool_size -= released;
+    ALLOC_SLAB[OBJECT_SLAB] = ALLOC_SLAB[PAIR_SLAB] = SLABS;
+}
+
+/* Allocation profiling, compiled in with -DALLOC_PROFILE (for instance
+   `make CFLAGS="-O2 -Wall -Iinclude -DALLOC_PROFILE"`) and gone entirely
+   otherwise. Every allocation is counted against the procedure eval is
+   applying at the time, by the name it was called by, and against the type
+   of object. Payloads count towards the bytes of their owner's type without
+   counting as objects of their own. The report, sorted by bytes, goes to
+   stderr at exit */
+#ifdef ALLOC_PROFILE
+struct profile_site {
+    struct profile_site *next; // in its bucket
+    char *name;
+    uint32_t hash;
+    size_t count[HASHTABLE + 1];
+    size_t bytes[HASHTABLE + 1];
+};
+
+#define PROFILE_BUCKETS 1024
+static struct profile_site *PROFILE_SITES[PROFILE_BUCKETS];
+static struct profile_site PROFILE_TOPLEVEL = {.name = "<toplevel>"};
+static struct profile_site PROFILE_LAMBDA = {.name = "<lambda>"};
+static struct profile_site *PROFILE_SITE = &PROFILE_TOPLEVEL;
+
+/* the site for an operator, procedures called other than by name share one */
+struct profile_site *profile_site(struct object *op) {
+    if (op == NULL || is_fixnum(op) || is_pair(op) || op->type != SYMBOL)
+        return &PROFILE_LAMBDA;
+    struct profile_site **bucket = &PROFILE_SITES[op->hash % PROFILE_BUCKETS];
+    struct profile_site *site;
+    for (site = *bucket; site != NULL; site = site->next)
+        if (site->hash == op->hash && !strcmp(site->name, op->string))
+            return site;
+    site = calloc(1, sizeof(struct profile_site));
+    if (site == NULL || (site->name = strdup(op->string)) == NULL)
+        error("Out of memory profiling allocations");
+    site->hash = op->hash;
+    site->next = *bucket;
+    *bucket = site;
+    return site;
+}
+
+static inline void profile_unwind(struct profile_site **site) {
+    PROFILE_SITE = *site;
+}
+
+/* profile_frame() puts the current site back when the scope is left, as
+   gc_frame() does for the roots */
+#define profile_frame()                                                        \
+    struct profile_site *profile_saved __attribute__((cleanup(profile_unwind))) \
+        = PROFILE_SITE
+#define profile_enter(op) (PROFILE_SITE = profile_site(op))
+#define profile_alloc(type, size)                                              \
+    (PROFILE_SITE->count[type]++, PROFILE_SITE->bytes[type] += (size))
+#define profile_bytes(type, size) (PROFILE_SITE->bytes[type] += (size))
+/* the current site tagged as a fixnum, to be kept on the VM's stack */
+#define profile_save() ((struct object *)((uintptr_t)PROFILE_SITE | 1))
+#define profile_restore(saved)                                                 \
+    (PROFILE_SITE = (struct profile_site *)((uintptr_t)(saved) & ~(uintptr_t)1))
+
+struct profile_row {
+    struct profile_site *site;
+    type_t type;
+};
+
+static int profile_row_cmp(const void *a, const void *b) {
+    const struct profile_row *x = a, *y = b;
+    size_t bx = x->site->bytes[x->type], by = y->site->bytes[y->type];
+    return (bx < by) - (bx > by);
+}
+
+void profile_report(void) {
+    struct profile_row *rows = NULL;
+    size_t n = 0, size = 0, objects = 0, bytes = 0, i;
+    int t;
+    for (i = 0; i <= PROFILE_BUCKETS + 1; i++) {
+        struct profile_site *site = i < PROFILE_BUCKETS ? PROFILE_SITES[i]
+                                    : i == PROFILE_BUCKETS ? &PROFILE_TOPLEVEL
+                                                           : &PROFILE_LAMBDA;
+        for (; site != NULL; site = i < PROFILE_BUCKETS ? site->next : NULL)
+            for (t = 0; t <= HASHTABLE; t++) {
+                if (!site->bytes[t])
+                    continue;
+                if (n == size) {
+                    size = size ? size << 1 : 256;
+                    rows = realloc(rows, sizeof(struct profile_row) * size);
+                    if (rows == NULL)
+                        error("Out of memory profiling allocations");
+                }
+                rows[n++] = (struct profile_row){site, t};
+                objects += site->count[t];
+                bytes += site->bytes[t];
+            }
+    }
+    qsort(rows, n, sizeof(struct profile_row), profile_row_cmp);
+    fprintf(stderr, "alloc: %zu objects, %zu bytes\n", objects, bytes);
+    fprintf(stderr, "alloc: %12s %10s %6s  %-10s %s\n", "bytes", "objects",
+            "%", "type", "procedure");
+    for (i = 0; i < n; i++) {
+        struct profile_site *site = rows[i].site;
+        fprintf(stderr, "alloc: %12zu %10zu %5.1f%%  %-10s %s\n",
+                site->bytes[rows[i].type], site->count[rows[i].type],
+                100.0 * site->bytes[rows[i].type] / bytes,
+                TYPE_NAMES[rows[i].type], site->name);
     }
+    free(rows);
 }
+#else
+#define profile_frame()
+#define profile_enter(op)
+#define profile_alloc(type, size)
+#define profile_bytes(type, size)
+#define profile_save() NIL
+#define profile_restore(saved) ((void)(saved))
+#endif
 
-struct object *alloc(void *workspace) {
-    gc_pool_maintain(workspace);
-    struct object *ret = pop_object(&GC_POOL_HEAD);
-    push_object(&GC_HEAD, ret);
-    ret->mark = false;
+/* Hand out a free cell of the given kind, sweeping slabs on the way */
+struct object *alloc_cell(enum slab_kind kind) {
+    struct slab *slab;
+    gc_pool_maintain();
+    for (;;) {
+        if (ALLOC_SLAB[kind] == NULL && sweeper_running) {
+            /* the sweeper may have freed up some of the slabs passed over */
+            join_sweeper();
+            ALLOC_SLAB[OBJECT_SLAB] = ALLOC_SLAB[PAIR_SLAB] = SLABS;
+        }
+        if (ALLOC_SLAB[kind] == NULL)
+            grow_pool(kind, (POOL_CELLS[kind] >> 1) + 1); // grow to 150%
+        slab = ALLOC_SLAB[kind];
+        if (slab->kind == kind) {
+            if (claim_slab(slab))
+                gc_objects_used -= sweep_slab(slab, &GC_STATS);
+            if (slab_swept(slab) && slab->free)
+                break;
+        }
+        ALLOC_SLAB[kind] = slab->next;
+    }
+    size_t w = slab->cursor;
+    while (slab->live[w] == ~(uint64_t)0)
+        w++;
+    slab->cursor = w;
+    size_t i = w * 64 + __builtin_ctzll(~slab->live[w]);
+    slab->live[w] |= bit_of(i);
+    slab->free--;
     gc_objects_used++;
+    gc_young_bytes += cell_size(kind);
+    gc_total_alloc++;
+    return cell_at(slab, i);
+}
+
+/* While marking, new objects are born grey: their fields are traced once the
+   caller has filled them in. Nothing can be traced before then, so the type
+   can be set up front */
+struct object *alloc(type_t type) {
+    struct object *ret = alloc_cell(OBJECT_SLAB);
+    ret->type = type;
+    profile_alloc(type, sizeof(struct object));
+    if (GC_PHASE == GC_MARKING) {
+        set_mark(ret);
+        stack_push(&MARK_STACK, ret);
+    }
     return ret;
 }
 
-void mark_object(struct object *obj) {
-    if (obj == NULL || obj->mark)
+struct object *alloc_pair(void) {
+    struct object *ret = alloc_cell(PAIR_SLAB);
+    profile_alloc(LIST, PAIR_SIZE);
+    if (GC_PHASE == GC_MARKING) {
+        set_mark(ret);
+        stack_push(&MARK_STACK, ret);
+    }
+    return ret;
+}
+
+/* check the clock every so many units of work when running against a deadline
+ */
+#define past_deadline(deadline, work)                                          \
+    ((deadline) && ++(work) % 256 == 0 && gc_now_us() >= (deadline))
+
+void mark_push(struct object *obj) {
+    if (obj == NULL || is_fixnum(obj) || !set_mark(obj))
         return;
 #ifdef DEBUG_GC
     print_exp("marking: ", obj);
     putchar('\n');
 #endif
-    obj->mark = true;
-    switch (obj->type) {
-    case LIST:
-        mark_object(obj->car);
-        mark_object(obj->cdr);
-        break;
-    case VECTOR: {
-        int i;
-        for (i = 0; i < obj->vsize; i++) {
-            if (obj->vector[i] != NULL)
-                mark_object(obj->vector[i]);
+    type_t type = type_of(obj);
+    if (type == LIST || type == VECTOR || type == HASHTABLE)
+        stack_push(&MARK_STACK, obj);
+}
+
+/* Visit grey objects until the stack is empty or, given a deadline, until it
+   has passed. Returns true once there is nothing left to mark */
+bool mark_drain(uint64_t deadline) {
+    int work = 0;
+    while (MARK_STACK.top > 0) {
+        if (past_deadline(deadline, work))
+            return false;
+        struct object *obj = MARK_STACK.items[--MARK_STACK.top];
+        if (type_of(obj) == VECTOR) {
+            int i;
+            for (i = 0; i < obj->vsize; i++)
+                mark_push(obj->vector[i]);
+            continue;
         }
-        break;
-    }
-    default:
-        break;
+        if (type_of(obj) == HASHTABLE) {
+            uint32_t i;
+            for (i = 0; i < obj->capacity; i++)
+                if (obj->entries[i].hash != 0) {
+                    mark_push(obj->entries[i].key);
+                    mark_push(obj->entries[i].value);
+                }
+            continue;
+        }
+        if (type_of(obj) != LIST)
+            continue;
+        /* walk the cdr chain in place, only deferring the cars */
+        for (;;) {
+            mark_push(obj->car);
+            obj = obj->cdr;
+            if (obj == NULL || type_of(obj) != LIST || !set_mark(obj))
+                break;
+#ifdef DEBUG_GC
+            print_exp("marking: ", obj);
+            putchar('\n');
+#endif
+            if (past_deadline(deadline, work)) {
+                stack_push(&MARK_STACK, obj);
+                return false;
+            }
+        }
+        mark_push(obj);
     }
+    return true;
 }
 
-void collect_hashed(struct object *obj) {
-    ht_delete(obj);
-    free(obj->string);
+/* Parallel marking. Once a full collection has the world stopped to finish
+   marking, the grey objects can be handed out to gc_mark_threads threads.
+   Each marks out of a work-stealing deque of its own (Chase and Lev, with the
+   orderings from Le et al.), pushing and popping at the bottom while idle
+   threads steal from the top. Mark bits are set with an atomic or, so the
+   thread that flips a bit is the one that goes on to trace the object. A
+   thread with nothing to take or steal counts itself idle, and once every
+   thread is idle there is nothing left anywhere */
+struct mark_array {
+    size_t size; // a power of two
+    struct mark_array *prev; // outgrown, freed once marking is over
+    struct object *items[];
+};
+
+struct mark_deque {
+    int64_t top;
+    int64_t bottom;
+    struct mark_array *array;
+    size_t old_bytes; // marked by this thread, added up at the end
+};
+
+#define GC_MAX_MARK_THREADS 64
+static size_t gc_mark_threads = 1;
+static struct mark_deque *DEQUES = NULL;
+static size_t mark_deques;  // in use by this round of marking
+static size_t mark_workers; // threads actually marking
+static size_t mark_idle;
+
+struct mark_array *mark_array_new(size_t size, struct mark_array *prev) {
+    struct mark_array *array =
+        malloc(sizeof(struct mark_array) + sizeof(struct object *) * size);
+    if (array == NULL)
+        error("Out of memory growing mark deque");
+    array->size = size;
+    array->prev = prev;
+    return array;
 }
 
-void debug_gc(struct object *obj) {
-    char *types[6] = {"INTEGER", "SYMBOL",    "STRING",
-                      "LIST",    "PRIMITIVE", "VECTOR"};
-    printf("\nCollecting object at %p, of type %s, value: ", (void *)obj,
-           types[obj->type]);
-    print_exp(NULL, obj);
-    putchar('\n');
+#define array_get(a, i)                                                        \
+    __atomic_load_n(&(a)->items[(i) & ((a)->size - 1)], __ATOMIC_RELAXED)
+#define array_put(a, i, x)                                                     \
+    __atomic_store_n(&(a)->items[(i) & ((a)->size - 1)], (x), __ATOMIC_RELAXED)
+
+/* only ever called by the deque's owner */
+void deque_push(struct mark_deque *deque, struct object *obj) {
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    struct mark_array *a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    if (b - t > (int64_t)a->size - 1) {
+        struct mark_array *bigger = mark_array_new(a->size << 1, a);
+        int64_t i;
+        for (i = t; i < b; i++)
+            array_put(bigger, i, array_get(a, i));
+        __atomic_store_n(&deque->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+    array_put(a, b, obj);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
 }
 
-int gc_sweep() {
-    struct object *obj = GC_HEAD;
-    struct object *tmp, *prev = NULL;
-    int freed = 0;
-    while (obj != NULL) {
-        if (obj->mark) {
-            obj->mark = false;
-            prev = obj;
-            obj = obj->gc_next;
-        } else {
-            if (prev != NULL)
-                prev->gc_next = obj->gc_next;
-            // object was the gc head, so move everything down one
-            if (obj == GC_HEAD)
-                GC_HEAD = obj->gc_next;
-
-            tmp = obj;
-            obj = obj->gc_next;
-#ifdef DEBUG_GC
-            debug_gc(tmp);
-#endif
-            if (tmp->type == STRING || tmp->type == SYMBOL)
-                collect_hashed(tmp);
-            push_object(&GC_POOL_HEAD, tmp);
-            freed++;
-            gc_objects_used--;
+/* only ever called by the deque's owner, returns NULL once it is empty */
+struct object *deque_take(struct mark_deque *deque) {
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    struct mark_array *a = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    struct object *obj = NULL;
+    __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+    if (t <= b) {
+        obj = array_get(a, b);
+        if (t == b) {
+            /* the last one, race the thieves for it */
+            if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED))
+                obj = NULL;
+            __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
         }
+    } else {
+        __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
     }
-    return freed;
+    return obj;
 }
 
-void gc_mark(void *workspace_root) {
-    mark_object(ENV); // mark global environment
-    void **workspace = workspace_root;
-    /* pretty ugly this is
-     * iterate over workspace until we find the (void *)1 value
-     * marking off each object as we go.
-     * when we find the (void *)1 value, test if the last element is null
-     * if it is, we're at the end of the workspace chain.
-     */
-    for (;;) {
+/* called by any other thread, returns NULL if there was nothing to steal or
+   it lost the race for it */
+struct object *deque_steal(struct mark_deque *deque) {
+    int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    struct mark_array *a = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    struct object *obj = array_get(a, t);
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return obj;
+}
+
+bool deque_empty(struct mark_deque *deque) {
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* set_mark for when other threads may be setting bits in the same word */
+bool set_mark_atomic(struct mark_deque *deque, struct object *obj) {
+    struct slab *slab = slab_of(obj);
+    size_t i = cell_index(slab, obj);
+    if (__atomic_load_n(&slab->marks[i / 64], __ATOMIC_RELAXED) & bit_of(i))
+        return false;
+    if (__atomic_fetch_or(&slab->marks[i / 64], bit_of(i), __ATOMIC_RELAXED) &
+        bit_of(i))
+        return false;
+    deque->old_bytes += object_bytes(slab, obj);
+    return true;
+}
+
+void mark_push_parallel(struct mark_deque *deque, struct object *obj) {
+    if (obj == NULL || is_fixnum(obj) || !set_mark_atomic(deque, obj))
+        return;
+    type_t type = type_of(obj);
+    if (type == LIST || type == VECTOR || type == HASHTABLE)
+        deque_push(deque, obj);
+}
+
+/* trace one grey object, the same way mark_drain does */
+void mark_object_parallel(struct mark_deque *deque, struct object *obj) {
+    if (type_of(obj) == VECTOR) {
         int i;
-        for (i = 0; workspace[i] != (void *)1; i++) {
-            if (workspace[i] != NULL)
-                mark_object(*(struct object **)workspace[i]);
+        for (i = 0; i < obj->vsize; i++)
+            mark_push_parallel(deque, obj->vector[i]);
+        return;
+    }
+    if (type_of(obj) == HASHTABLE) {
+        uint32_t i;
+        for (i = 0; i < obj->capacity; i++)
+            if (obj->entries[i].hash != 0) {
+                mark_push_parallel(deque, obj->entries[i].key);
+                mark_push_parallel(deque, obj->entries[i].value);
+            }
+        return;
+    }
+    if (type_of(obj) != LIST)
+        return;
+    for (;;) {
+        mark_push_parallel(deque, obj->car);
+        obj = obj->cdr;
+        if (obj == NULL || type_of(obj) != LIST || !set_mark_atomic(deque, obj))
+            break;
+    }
+    mark_push_parallel(deque, obj);
+}
+
+/* try each of the other deques once, starting after our own */
+struct object *mark_steal(size_t self) {
+    size_t i;
+    for (i = 1; i < mark_deques; i++) {
+        struct object *obj = deque_steal(&DEQUES[(self + i) % mark_deques]);
+        if (obj != NULL)
+            return obj;
+    }
+    return NULL;
+}
+
+bool mark_work_left(void) {
+    size_t i;
+    for (i = 0; i < mark_deques; i++)
+        if (!deque_empty(&DEQUES[i]))
+            return true;
+    return false;
+}
+
+void *mark_worker(void *arg) {
+    size_t self = (size_t)arg;
+    struct mark_deque *deque = &DEQUES[self];
+    struct object *obj;
+    for (;;) {
+        while ((obj = deque_take(deque)) != NULL ||
+               (obj = mark_steal(self)) != NULL)
+            mark_object_parallel(deque, obj);
+        __atomic_add_fetch(&mark_idle, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&mark_idle, __ATOMIC_SEQ_CST) ==
+                __atomic_load_n(&mark_workers, __ATOMIC_SEQ_CST))
+                return NULL;
+            if (mark_work_left()) {
+                __atomic_sub_fetch(&mark_idle, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            sched_yield();
         }
-        if ((workspace = (void *)workspace[i + 1]) == NULL)
+    }
+}
+
+/* Mark everything reachable from the grey stack with gc_mark_threads threads,
+   the caller being one of them. Makes do with fewer if they cannot all be
+   started */
+void mark_parallel(void) {
+    pthread_t threads[GC_MAX_MARK_THREADS];
+    size_t i, started;
+    if (DEQUES == NULL) {
+        DEQUES = calloc(GC_MAX_MARK_THREADS, sizeof(struct mark_deque));
+        if (DEQUES == NULL)
+            error("Out of memory allocating mark deques");
+        for (i = 0; i < GC_MAX_MARK_THREADS; i++)
+            DEQUES[i].array = mark_array_new(1024, NULL);
+    }
+    /* deal the grey objects out between the deques */
+    mark_deques = mark_workers = gc_mark_threads;
+    for (i = 0; MARK_STACK.top > 0; i = (i + 1) % mark_deques)
+        deque_push(&DEQUES[i], MARK_STACK.items[--MARK_STACK.top]);
+    mark_idle = 0;
+    for (started = 1; started < mark_deques; started++)
+        if (pthread_create(&threads[started], NULL, mark_worker,
+                           (void *)started))
             break;
+    /* the deques left without a thread are there for the others to steal */
+    __atomic_sub_fetch(&mark_workers, mark_deques - started, __ATOMIC_SEQ_CST);
+    mark_worker((void *)0);
+    for (i = 1; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (i = 0; i < mark_deques; i++) {
+        struct mark_array *array = DEQUES[i].array;
+        while (array->prev != NULL) {
+            struct mark_array *prev = array->prev;
+            array->prev = prev->prev;
+            free(prev);
+        }
+        gc_old_bytes += DEQUES[i].old_bytes;
+        DEQUES[i].old_bytes = 0;
+        DEQUES[i].top = DEQUES[i].bottom = 0;
+    }
+}
+
+/* Treat the remembered set as extra roots: mark whatever the old objects in it
+   currently point to */
+void mark_remembered(void) {
+    size_t i;
+    for (i = 0; i < REMEMBERED.top; i++) {
+        struct object *obj = REMEMBERED.items[i];
+        if (type_of(obj) == VECTOR) {
+            int j;
+            for (j = 0; j < obj->vsize; j++)
+                mark_push(obj->vector[j]);
+        } else if (type_of(obj) == HASHTABLE) {
+            uint32_t j;
+            for (j = 0; j < obj->capacity; j++)
+                if (obj->entries[j].hash != 0) {
+                    mark_push(obj->entries[j].key);
+                    mark_push(obj->entries[j].value);
+                }
+        } else if (type_of(obj) == LIST) {
+            mark_push(obj->car);
+            mark_push(obj->cdr);
+        }
+    }
+}
+
+/* Every collection leaves the nursery empty, so nothing stays remembered */
+void forget_remembered(void) {
+    while (REMEMBERED.top > 0) {
+        struct object *obj = REMEMBERED.items[--REMEMBERED.top];
+        struct slab *slab = slab_of(obj);
+        size_t i = cell_index(slab, obj);
+        slab->remembered[i / 64] &= ~bit_of(i);
+    }
+}
+
+void mark_roots(void) {
+    size_t i;
+    mark_push(ENV); // mark global environment
+    mark_push(GLOBAL_FRAME);
+    mark_push(GLOBALS);
+    mark_push(UNBOUND);
+    mark_push(OR); // the other special forms are bound to themselves
+    mark_push(COND);
+    mark_push(ELSE);
+    for (i = 0; i < roots_top; i++)
+        mark_push(*ROOTS[i]);
+    for (i = 0; i < vm_sp; i++)
+        mark_push(VM_STACK[i]);
+}
+
+/* collect the nursery only, old objects are already marked */
+void gc_minor(void) {
+    join_sweeper();
+    mark_roots();
+    mark_remembered();
+    mark_drain(0);
+    forget_remembered();
+    sweep_large_objects();
+    gc_young_bytes = 0;
+    gc_new_epoch();
+    gc_record_collection(&GC_STATS.minor);
+}
+
+/* Begin a full collection by clearing the marks and shading the roots. A slab
+   left unswept would lose track of its dead objects, so those go first */
+void gc_start(void) {
+    struct slab *slab;
+    sweep_all();
+    forget_remembered();
+    for (slab = SLABS; slab != NULL; slab = slab->next)
+        memset(slab->marks, 0, sizeof(slab->marks));
+    gc_old_bytes = 0;
+    GC_PHASE = GC_MARKING;
+    gc_slice_countdown = GC_SLICE_ALLOCS;
+    mark_roots();
+}
+
+/* Local variables are written without a barrier, so rescan the roots before
+   calling marking complete. Everything allocated while marking was born
+   marked, so the nursery is empty again */
+void gc_finish_marking(void) {
+    mark_roots();
+    if (gc_mark_threads > 1)
+        mark_parallel();
+    else
+        mark_drain(0);
+    sweep_large_objects();
+    gc_young_bytes = 0;
+    gc_new_epoch();
+    SWEEP_SLAB = SLABS;
+    GC_PHASE = GC_SWEEPING;
+    if (gc_background_sweep)
+        start_sweeper();
+}
+
+/* sweep a slice of the heap, returns true once it has all been swept */
+bool sweep_slice(uint64_t deadline) {
+    int work = 0;
+    for (; SWEEP_SLAB != NULL; SWEEP_SLAB = SWEEP_SLAB->next) {
+        if (deadline && ++work % 8 == 0 && gc_now_us() >= deadline)
+            return false;
+        if (claim_slab(SWEEP_SLAB))
+            gc_objects_used -= sweep_slab(SWEEP_SLAB, &GC_STATS);
+    }
+    return true;
+}
+
+void gc_end(void) {
+    size_t slabs = POOL_CELLS[OBJECT_SLAB] / SLAB_CELLS(OBJECT_SLAB) +
+                   POOL_CELLS[PAIR_SLAB] / SLAB_CELLS(PAIR_SLAB);
+    size_t target = 0;
+    int i;
+    GC_PHASE = GC_IDLE;
+    gc_old_limit = gc_old_bytes * 100 / gc_target_live_pct;
+    if (gc_old_limit < gc_nursery_bytes)
+        gc_old_limit = gc_nursery_bytes;
+    /* the most the heap should need before the next full collection */
+    gc_heap_needs[GC_STATS.full % GC_SIZING_WINDOW] =
+        (gc_old_limit + gc_nursery_bytes) / SLAB_SIZE + 1;
+    for (i = 0; i < GC_SIZING_WINDOW; i++)
+        if (gc_heap_needs[i] > target)
+            target = gc_heap_needs[i];
+    if (slabs * 100 > target * (100 + gc_shrink_slack_pct))
+        shrink_pool(slabs - target);
+    /* no need to collect before the heap kept around for it has filled up */
+    if (gc_old_limit < target * SLAB_SIZE - gc_nursery_bytes)
+        gc_old_limit = target * SLAB_SIZE - gc_nursery_bytes;
+    gc_record_collection(&GC_STATS.full);
+}
+
+/* advance an ongoing full collection by one pause budget's worth of work */
+void gc_step(void) {
+    uint64_t start = gc_now_us();
+    uint64_t deadline = start + gc_pause_budget_us;
+    if (GC_PHASE == GC_MARKING) {
+        if (mark_drain(deadline))
+            gc_finish_marking();
+    } else if (sweeper_running) {
+        gc_slice_countdown = GC_SLICE_ALLOCS;
+        if (!__atomic_load_n(&sweeper_done, __ATOMIC_ACQUIRE))
+            return; // not a pause, nothing was done
+        join_sweeper();
+        gc_end();
+    } else if (sweep_slice(deadline)) {
+        gc_end();
     }
+    gc_slice_countdown = GC_SLICE_ALLOCS;
+    gc_record_pause(start);
+}
+
+/* invoke the garbage collector on the whole heap, without stopping. Returns
+   the number of objects freed */
+int gc_pass(void) {
+    uint64_t start = gc_now_us();
+    if (GC_PHASE == GC_MARKING)
+        gc_finish_marking();
+    gc_start();
+    gc_finish_marking();
+    int freed = sweep_all();
+    SWEEP_SLAB = NULL;
+    gc_end();
+    gc_record_pause(start);
+    return freed;
 }
 
-/* invoke the garbage collector */
-int gc_pass(void *workspace) {
-    gc_mark(workspace);
-    return gc_sweep();
+void gc_dump_stats(FILE *out) {
+    int i;
+    fprintf(out, "gc: %zu minor, %zu full, %zu pauses, %llu us total, "
+                 "%llu us max\n",
+            GC_STATS.minor, GC_STATS.full, GC_STATS.pauses,
+            (unsigned long long)GC_STATS.total_pause_us,
+            (unsigned long long)gc_max_pause_us);
+    fprintf(out, "gc: pauses");
+    for (i = 0; i < GC_PAUSE_BUCKETS; i++)
+        if (GC_STATS.pause_histogram[i])
+            fprintf(out, " %s%dus:%zu", i < GC_PAUSE_BUCKETS - 1 ? "<" : ">=",
+                    1 << (i < GC_PAUSE_BUCKETS - 1 ? i : i - 1),
+                    GC_STATS.pause_histogram[i]);
+    fprintf(out, "\ngc: freed");
+    for (i = 0; i <= HASHTABLE; i++)
+        fprintf(out, " %s:%zu", TYPE_NAMES[i], GC_STATS.freed[i]);
+    fprintf(out, "\ngc: %zu used of %zu pooled, %zu allocated\n",
+            gc_objects_used, gc_pool_size, gc_total_alloc);
+    fprintf(out, "gc: %zu bytes in vectors, %zu in hash tables (%zu large), "
+                 "%zu in strings\n",
+            GC_STATS.vector_bytes, GC_STATS.table_bytes, GC_STATS.large_bytes,
+            GC_STATS.string_bytes);
+    fprintf(out, "gc: %zu slabs allocated, %zu freed\n",
+            GC_STATS.slabs_allocated, GC_STATS.slabs_freed);
 }
 
+void gc_dump_stats_at_exit(void) { gc_dump_stats(stderr); }
+
 /*============================================================================
   Constructors and etc
   ==============================================================================*/
@@ -348,110 +1641,147 @@ int __type_check(const char *func, struct object *obj, type_t type) {
     if (null(obj)) {
         fprintf(stderr, "Invalid argument to function %s: NIL\n", func);
         exit(1);
-    } else if (obj->type != type) {
-        char *types[6] = {"INTEGER", "SYMBOL",    "STRING",
-                          "LIST",    "PRIMITIVE", "VECTOR"};
+    } else if (type_of(obj) != type) {
+        char *types[7] = {"INTEGER",   "SYMBOL", "STRING",   "LIST",
+                          "PRIMITIVE", "VECTOR", "HASHTABLE"};
         fprintf(stderr, "Invalid argument to function %s. Expected %s got %s\n",
-                func, types[type], types[obj->type]);
+                func, types[type], types[type_of(obj)]);
         exit(1);
     }
     return 1;
 }
 
-struct object *make_vector(void *workspace, int size) {
-    struct object *ret = alloc(workspace);
-    ret->type = VECTOR;
-    ret->vector = malloc(sizeof(struct object *) * size);
+struct object *make_vector(int size) {
+    if (size < 0)
+        error("vector: size cannot be negative");
+    struct object *ret = alloc(VECTOR);
+    ret->vector = alloc_payload(ret, sizeof(struct object *) * size);
     ret->vsize = size;
-
-    memset(ret->vector, 0, size);
-
+    GC_STATS.vector_bytes += sizeof(struct object *) * size;
+    gc_young_bytes += sizeof(struct object *) * size;
+    profile_bytes(VECTOR, sizeof(struct object *) * size);
     return ret;
 }
 
-struct object *make_symbol(void *workspace, char *s) {
-    struct object *ret = ht_lookup(s);
+/* A symbol may only have been reachable from the table, and an unmarked
+   symbol in an unswept slab is dead until marked again. Its slab is claimed
+   for long enough to set the mark, so the sweeper cannot be halfway through
+   it, and if the sweeper already has it the symbol is as good as gone */
+struct object *make_symbol(char *s) {
+    uint32_t h = hash(s);
+    struct object *ret;
+    for (;;) {
+        lock_symbols();
+        ret = ht_lookup(s, h);
+        if (null(ret) || GC_PHASE == GC_MARKING || slab_swept(slab_of(ret)))
+            break;
+        struct slab *slab = slab_of(ret);
+        unsigned epoch = __atomic_load_n(&slab->epoch, __ATOMIC_ACQUIRE);
+        if (claim_slab(slab)) {
+            set_mark(ret);
+            __atomic_store_n(&slab->epoch, epoch, __ATOMIC_RELEASE);
+            break;
+        }
+        unlock_symbols();
+        while (!slab_swept(slab))
+            sched_yield();
+    }
+    unlock_symbols();
     if (null(ret)) {
-        ret = alloc(workspace);
-        ret->type = SYMBOL;
+        ret = alloc(SYMBOL);
         ret->string = strdup(s);
+        ret->hash = h;
+        ret->form = NOT_SPECIAL;
+        lock_symbols();
         ht_insert(ret);
+        unlock_symbols();
+    } else if (GC_PHASE == GC_MARKING) {
+        mark_push(ret);
     }
     return ret;
 }
 
-struct object *make_integer(void *workspace, int x) {
-    struct object *ret = alloc(workspace);
-    ret->type = INTEGER;
+/* Strings are not interned. The object takes ownership of the malloc'd buffer,
+   which is released when the string is collected */
+struct object *make_string(char *s, size_t length) {
+    struct object *ret = alloc(STRING);
+    ret->string = s;
+    ret->length = length;
+    GC_STATS.string_bytes += length + 1;
+    gc_young_bytes += length + 1;
+    profile_bytes(STRING, length + 1);
+    return ret;
+}
+
+/* Only integers too wide for a fixnum are boxed */
+struct object *make_integer(int64_t x) {
+    if (x >= FIXNUM_MIN && x <= FIXNUM_MAX)
+        return make_fixnum(x);
+    struct object *ret = alloc(INTEGER);
     ret->integer = x;
     return ret;
 }
 
-struct object *make_primitive(void *workspace, primitive_t x) {
-    struct object *ret = alloc(workspace);
-    ret->type = PRIMITIVE;
+struct object *make_primitive(primitive_t x) {
+    struct object *ret = alloc(PRIMITIVE);
     ret->primitive = x;
     return ret;
 }
 
-struct object *make_lambda(void *workspace, struct object *params,
-                           struct object *body) {
+struct object *make_lambda(struct object *params, struct object *body) {
     // Shouldn't need to localise here since `cons` makes sure they're
     // preserved.
-    return cons(workspace, LAMBDA, cons(workspace, params, body));
-}
-
-struct object *make_procedure(void *workspace, struct object *params,
-                              struct object *body, struct object *env) {
-    create_workspace(3);
-    set_local(0, body);
-    set_local(1, params);
-    set_local(2, env);
-    return cons(workspace, PROCEDURE,
-                cons(workspace, params,
-                     cons(workspace, body, cons(workspace, env, EMPTY_LIST))));
-}
-
-struct object *cons(void *workspace, struct object *x, struct object *y) {
-    create_workspace(2);
-    set_local(0, x);
-    set_local(1, y);
-    struct object *ret = alloc(workspace);
-    ret->type = LIST;
+    return cons(LAMBDA, cons(params, body));
+}
+
+struct object *make_procedure(struct object *params, struct object *body,
+                              struct object *env) {
+    gc_frame();
+    gc_root(body);
+    gc_root(params);
+    gc_root(env);
+    return cons(PROCEDURE, cons(params, cons(body, cons(env, EMPTY_LIST))));
+}
+
+struct object *cons(struct object *x, struct object *y) {
+    gc_frame();
+    gc_root(x);
+    gc_root(y);
+    struct object *ret = alloc_pair();
     ret->car = x;
     ret->cdr = y;
     return ret;
 }
 
+/* is_pair is false for NULL and NIL as well */
 struct object *car(struct object *cell) {
-    if (null(cell) || cell->type != LIST)
+    if (!is_pair(cell))
         return NIL;
     return cell->car;
 }
 
 struct object *cdr(struct object *cell) {
-    if (null(cell) || cell->type != LIST)
+    if (!is_pair(cell))
         return NIL;
     return cell->cdr;
 }
 
-struct object *append(void *workspace, struct object *l1, struct object *l2) {
+struct object *append(struct object *l1, struct object *l2) {
     if (null(l1))
         return l2;
-    create_workspace(2);
-    set_local(0, l1);
-    set_local(1, l2);
-    return cons(workspace, car(l1), append(workspace, cdr(l1), l2));
+    gc_frame();
+    gc_root(l1);
+    gc_root(l2);
+    return cons(car(l1), append(cdr(l1), l2));
 }
 
-struct object *reverse(void *workspace, struct object *list,
-                       struct object *first) {
+struct object *reverse(struct object *list, struct object *first) {
     if (null(list))
         return first;
-    create_workspace(2);
-    set_local(0, list);
-    set_local(1, first);
-    return reverse(workspace, cdr(list), cons(workspace, car(list), first));
+    gc_frame();
+    gc_root(list);
+    gc_root(first);
+    return reverse(cdr(list), cons(car(list), first));
 }
 
 bool is_equal(struct object *x, struct object *y) {
@@ -460,16 +1790,20 @@ bool is_equal(struct object *x, struct object *y) {
         return true;
     if (null(x) || null(y))
         return false;
-    if (x->type != y->type)
+    if (type_of(x) != type_of(y))
         return false;
-    switch (x->type) {
+    switch (type_of(x)) {
     case LIST:
         return false;
     case INTEGER:
-        return x->integer == y->integer;
+        return integer_value(x) == integer_value(y);
     case SYMBOL:
+        return false; // interned, so x == y is the only way to be equal
     case STRING:
-        return !strcmp(x->string, y->string);
+        return x->length == y->length &&
+               !memcmp(x->string, y->string, x->length);
+    case HASHTABLE:
+        return false; // tables are equal only to themselves
     }
     return false;
 }
@@ -477,15 +1811,22 @@ bool is_equal(struct object *x, struct object *y) {
 bool not_false(struct object *x) {
     if (null(x) || is_equal(x, FALSE))
         return false;
-    if (x->type == INTEGER && x->integer == 0)
+    if (type_of(x) == INTEGER && integer_value(x) == 0)
         return false;
     return true;
 }
 
 bool is_tagged(struct object *cell, struct object *tag) {
-    if (null(cell) || cell->type != LIST)
+    if (!is_pair(cell))
         return false;
-    return is_equal(car(cell), tag);
+    return cell->car == tag; // tags are always symbols, which are interned
+}
+
+/* the special form exp is, if it is a list starting with the symbol of one */
+static inline enum special_form special_form(struct object *exp) {
+    if (!is_pair(exp) || null(exp->car) || type_of(exp->car) != SYMBOL)
+        return NOT_SPECIAL;
+    return exp->car->form;
 }
 
 int length(struct object *exp) {
@@ -493,294 +1834,1125 @@ int length(struct object *exp) {
         return 0;
     return 1 + length(cdr(exp));
 }
+/*==============================================================================
+  Hash tables
+  ==============================================================================*/
+/* Open addressing (Robin Hood) again, as for the symbol table, but keyed by any
+   object and holding a value for each key. Keys are compared the way eq? does,
+   or for tables made with equal?, element by element all the way down through
+   pairs. Each entry caches the hash of its key, so growing the table never
+   rehashes and probes only compare keys when the hashes match. The entries are
+   a payload of the table object, so big tables live in the large object space
+ */
+#define TABLE_MIN_CAPACITY 8
+#define KEY_HASH_PAIRS 64 // how many of a key's pairs an equal? table hashes
+#define TABLE_DIST(t, h, pos)                                                  \
+    (((pos) - ((h) & ((t)->capacity - 1))) & ((t)->capacity - 1))
+
+/* the finalizer of MurmurHash3, so that pointers and small integers spread
+   over the low bits */
+static inline uint32_t mix_hash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+/* the hash of key, looking into no more than *pairs of its pairs, so that a
+   circular key hashes too */
+static uint32_t hash_key(struct object *key, bool equal, int *pairs) {
+    uint64_t h = 0;
+    for (; equal && is_pair(key) && *pairs > 0; key = key->cdr) {
+        --*pairs;
+        h = (h + hash_key(key->car, true, pairs)) * 31;
+    }
+    if (null(key) || (equal && is_pair(key)))
+        h = mix_hash(h);
+    else if (type_of(key) == INTEGER)
+        h = mix_hash(h + integer_value(key));
+    else if (type_of(key) == STRING)
+        h = mix_hash(h + hash(key->string));
+    else if (type_of(key) == SYMBOL)
+        h = mix_hash(h + key->hash); // same order from run to run
+    else
+        h = mix_hash(h + (uintptr_t)key);
+    return h ? h : 1; // 0 marks a free slot
+}
+
+/* equal keys hash the same, whichever way the table compares them */
+uint32_t key_hash(struct object *key, bool equal) {
+    int pairs = KEY_HASH_PAIRS;
+    return hash_key(key, equal, &pairs);
+}
+
+/* eq? when equal is false, otherwise equal?, comparing pairs element by
+   element all the way down */
+bool keys_equal(struct object *x, struct object *y, bool equal) {
+    for (; equal && is_pair(x) && is_pair(y) && x != y; x = x->cdr, y = y->cdr)
+        if (!keys_equal(x->car, y->car, true))
+            return false;
+    return is_equal(x, y);
+}
+
+struct object *make_hash_table(bool equal) {
+    struct object *ret = alloc(HASHTABLE);
+    ret->entries = alloc_payload(
+        ret, sizeof(struct table_entry) * TABLE_MIN_CAPACITY);
+    ret->capacity = TABLE_MIN_CAPACITY;
+    ret->count = 0;
+    ret->equal = equal;
+    GC_STATS.table_bytes += sizeof(struct table_entry) * TABLE_MIN_CAPACITY;
+    gc_young_bytes += sizeof(struct table_entry) * TABLE_MIN_CAPACITY;
+    profile_bytes(HASHTABLE, sizeof(struct table_entry) * TABLE_MIN_CAPACITY);
+    return ret;
+}
+
+/* put an entry whose key is not in the table yet */
+static void table_place(struct object *table, struct table_entry entry) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t pos = entry.hash & mask;
+    uint32_t dist = 0;
+    for (;;) {
+        struct table_entry *slot = &table->entries[pos];
+        if (slot->hash == 0) {
+            *slot = entry;
+            return;
+        }
+        uint32_t existing = TABLE_DIST(table, slot->hash, pos);
+        if (existing < dist) {
+            struct table_entry tmp = *slot;
+            *slot = entry;
+            entry = tmp;
+            dist = existing;
+        }
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+/* Move the entries over to a fresh payload. Only malloc and mmap are called,
+   so there is no collection to worry about halfway through */
+static void table_resize(struct object *table, uint32_t capacity) {
+    struct table_entry *old = table->entries;
+    uint32_t old_capacity = table->capacity;
+    uint32_t i;
+    if (capacity == 0)
+        error("hash table: too many entries");
+    table->entries =
+        alloc_payload(table, sizeof(struct table_entry) * capacity);
+    table->capacity = capacity;
+    for (i = 0; i < old_capacity; i++)
+        if (old[i].hash != 0)
+            table_place(table, old[i]);
+    free_payload(old, sizeof(struct table_entry) * old_capacity);
+    GC_STATS.table_bytes += sizeof(struct table_entry) * capacity;
+    GC_STATS.table_bytes -= sizeof(struct table_entry) * old_capacity;
+    gc_young_bytes += sizeof(struct table_entry) * capacity;
+    profile_bytes(HASHTABLE, sizeof(struct table_entry) * capacity);
+}
+
+/* Returns the slot holding key, or -1 if it is not present */
+ssize_t table_find(struct object *table, struct object *key, uint32_t h) {
+    uint32_t mask = table->capacity - 1;
+    uint32_t pos = h & mask;
+    uint32_t dist = 0;
+    for (;;) {
+        struct table_entry *slot = &table->entries[pos];
+        if (slot->hash == 0 ||
+            dist > TABLE_DIST(table, slot->hash, pos))
+            return -1;
+        if (slot->hash == h && keys_equal(slot->key, key, table->equal))
+            return pos;
+        pos = (pos + 1) & mask;
+        dist++;
+    }
+}
+
+/* the caller runs the write barrier */
+void table_set(struct object *table, struct object *key, struct object *value) {
+    uint32_t h = key_hash(key, table->equal);
+    ssize_t pos = table_find(table, key, h);
+    if (pos >= 0) {
+        table->entries[pos].value = value;
+        return;
+    }
+    if ((uint32_t)table->count + 1 > HT_MAX_LOAD(table->capacity))
+        table_resize(table, table->capacity << 1);
+    table_place(table, (struct table_entry){key, value, h});
+    table->count++;
+}
+
+/* Remove key, shifting the rest of its cluster back a slot like ht_delete */
+void table_delete(struct object *table, struct object *key) {
+    uint32_t mask = table->capacity - 1;
+    ssize_t found = table_find(table, key, key_hash(key, table->equal));
+    if (found < 0)
+        return;
+    uint32_t pos = found;
+    for (;;) {
+        uint32_t next = (pos + 1) & mask;
+        struct table_entry *slot = &table->entries[next];
+        if (slot->hash == 0 || TABLE_DIST(table, slot->hash, next) == 0)
+            break;
+        table->entries[pos] = *slot;
+        pos = next;
+    }
+    memset(&table->entries[pos], 0, sizeof(struct table_entry));
+    table->count--;
+}
+
 /*==============================================================================
   Primitive operations
   ==============================================================================*/
 
-struct object *prim_type(void *workspace, struct object *args) {
-    char *types[6] = {"integer", "symbol",    "string",
-                      "list",    "primitive", "vector"};
-    create_workspace(1);
-    set_local(0, args);
-    return make_symbol(workspace, types[car(args)->type]);
+struct object *prim_type(struct object *args) {
+    gc_frame();
+    gc_root(args);
+    return make_symbol(TYPE_NAMES[type_of(car(args))]);
 }
 
-struct object *prim_get_env(void *workspace, struct object *args) {
+struct object *prim_get_env(struct object *args) {
     return ENV;
 }
-struct object *prim_set_env(void *workspace, struct object *args) {
+struct object *prim_set_env(struct object *args) {
     ENV = car(args);
     return NIL;
 }
 
-struct object *prim_list(void *workspace, struct object *args) {
+struct object *prim_list(struct object *args) {
     return (args);
 }
-struct object *prim_cons(void *workspace, struct object *args) {
-    return cons(workspace, car(args), cadr(args));
+struct object *prim_cons(struct object *args) {
+    return cons(car(args), cadr(args));
 }
 
-struct object *prim_car(void *workspace, struct object *args) {
+struct object *prim_car(struct object *args) {
 #ifdef STRICT
     ASSERT_TYPE(car(args), LIST);
 #endif
     return caar(args);
 }
 
-struct object *prim_cdr(void *workspace, struct object *args) {
+struct object *prim_cdr(struct object *args) {
 #ifdef STRICT
     ASSERT_TYPE(car(args), LIST);
 #endif
     return cdar(args);
 }
 
-struct object *prim_setcar(void *workspace, struct object *args) {
+struct object *prim_setcar(struct object *args) {
     ASSERT_TYPE(car(args), LIST);
+    gc_write_barrier(car(args), cadr(args));
     (args->car->car = (cadr(args)));
     return NIL;
 }
-struct object *prim_setcdr(void *workspace, struct object *args) {
+struct object *prim_setcdr(struct object *args) {
     ASSERT_TYPE(car(args), LIST);
+    gc_write_barrier(car(args), cadr(args));
     (args->car->cdr = (cadr(args)));
     return NIL;
 }
 
-struct object *prim_nullq(void *workspace, struct object *args) {
+struct object *prim_nullq(struct object *args) {
     return EOL(car(args)) ? TRUE : FALSE;
 }
 
-struct object *prim_pairq(void *workspace, struct object *args) {
-    if (car(args)->type != LIST)
+struct object *prim_pairq(struct object *args) {
+    if (type_of(car(args)) != LIST)
         return FALSE;
     return (atom(caar(args)) && atom(cdar(args))) ? TRUE : FALSE;
 }
 
-struct object *prim_listq(void *workspace, struct object *args) {
+struct object *prim_listq(struct object *args) {
     struct object *list = NULL;
-    if (car(args)->type != LIST)
+    if (type_of(car(args)) != LIST)
         return FALSE;
     for (list = car(args); !null(list); list = list->cdr)
-        if (!null(list->cdr) && (list->cdr->type != LIST))
+        if (!null(list->cdr) && (type_of(list->cdr) != LIST))
             return FALSE;
-    return (car(args)->type == LIST && prim_pairq(NULL, args) != TRUE) ? TRUE
-                                                                       : FALSE;
+    return (type_of(car(args)) == LIST && prim_pairq(args) != TRUE) ? TRUE
+                                                                     : FALSE;
 }
 
-struct object *prim_atomq(void *workspace, struct object *sexp) {
+struct object *prim_atomq(struct object *sexp) {
     return atom(car(sexp)) ? TRUE : FALSE;
 }
 
 /* = primitive, only valid for numbers */
-struct object *prim_neq(void *workspace, struct object *args) {
-    if ((car(args)->type != INTEGER) || (cadr(args)->type != INTEGER))
+struct object *prim_neq(struct object *args) {
+    if ((type_of(car(args)) != INTEGER) || (type_of(cadr(args)) != INTEGER))
         return FALSE;
-    return (car(args)->integer == cadr(args)->integer) ? TRUE : FALSE;
+    return (integer_value(car(args)) == integer_value(cadr(args))) ? TRUE
+                                                                   : FALSE;
 }
 
 /* eq? primitive, checks memory location, or if equal values for primitives */
-struct object *prim_eq(void *workspace, struct object *args) {
+struct object *prim_eq(struct object *args) {
     return is_equal(car(args), cadr(args)) ? TRUE : FALSE;
 }
 
-struct object *prim_equal(void *workspace, struct object *args) {
-    if (is_equal(car(args), cadr(args)))
-        return TRUE;
-    if ((car(args)->type == LIST) && (cadr(args)->type == LIST)) {
-        struct object *a, *b;
-        a = car(args);
-        b = cadr(args);
-        while (!null(a) && !null(b)) {
-            if (!is_equal(car(a), car(b)))
-                return FALSE;
-            a = cdr(a);
-            b = cdr(b);
-        }
-        return TRUE;
-    }
-    return FALSE;
+/* equal? primitive, compares the way tables made with equal? do */
+struct object *prim_equal(struct object *args) {
+    return keys_equal(car(args), cadr(args), true) ? TRUE : FALSE;
 }
 
-struct object *prim_add(void *workspace, struct object *list) {
+struct object *prim_add(struct object *list) {
     ASSERT_TYPE(car(list), INTEGER);
-    int64_t total = car(list)->integer;
+    int64_t total = integer_value(car(list));
     list = cdr(list);
     while (!EOL(car(list))) {
         ASSERT_TYPE(car(list), INTEGER);
-        total += car(list)->integer;
+        total += integer_value(car(list));
         list = cdr(list);
     }
-    return make_integer(workspace, total);
+    return make_integer(total);
 }
 
-struct object *prim_sub(void *workspace, struct object *list) {
+struct object *prim_sub(struct object *list) {
     ASSERT_TYPE(car(list), INTEGER);
-    int64_t total = car(list)->integer;
+    int64_t total = integer_value(car(list));
     list = cdr(list);
     while (!null(list)) {
         ASSERT_TYPE(car(list), INTEGER);
-        total -= car(list)->integer;
+        total -= integer_value(car(list));
         list = cdr(list);
     }
-    return make_integer(workspace, total);
+    return make_integer(total);
 }
 
-struct object *prim_div(void *workspace, struct object *list) {
+struct object *prim_div(struct object *list) {
     ASSERT_TYPE(car(list), INTEGER);
-    int64_t total = car(list)->integer;
+    int64_t total = integer_value(car(list));
     list = cdr(list);
     while (!null(list)) {
         ASSERT_TYPE(car(list), INTEGER);
-        total /= car(list)->integer;
+        total /= integer_value(car(list));
         list = cdr(list);
     }
-    return make_integer(workspace, total);
+    return make_integer(total);
 }
 
-struct object *prim_mul(void *workspace, struct object *list) {
+struct object *prim_mul(struct object *list) {
     ASSERT_TYPE(car(list), INTEGER);
-    int64_t total = car(list)->integer;
+    int64_t total = integer_value(car(list));
     list = cdr(list);
     while (!null(list)) {
         ASSERT_TYPE(car(list), INTEGER);
-        total *= car(list)->integer;
+        total *= integer_value(car(list));
         list = cdr(list);
     }
-    return make_integer(workspace, total);
+    return make_integer(total);
+}
+struct object *prim_gt(struct object *sexp) {
+    ASSERT_TYPE(car(sexp), INTEGER);
+    ASSERT_TYPE(cadr(sexp), INTEGER);
+    return (integer_value(car(sexp)) > integer_value(cadr(sexp))) ? TRUE : NIL;
+}
+
+struct object *prim_lt(struct object *sexp) {
+    ASSERT_TYPE(car(sexp), INTEGER);
+    ASSERT_TYPE(cadr(sexp), INTEGER);
+    return (integer_value(car(sexp)) < integer_value(cadr(sexp))) ? TRUE : NIL;
+}
+
+struct object *prim_print(struct object *args) {
+    print_exp(NULL, car(args));
+    printf("\n");
+    return NIL;
+}
+
+struct object *prim_exit(struct object *args) {
+    exit(0);
+}
+
+struct object *prim_read(struct object *args) {
+    return read_exp(stdin);
+}
+
+struct object *prim_vget(struct object *args) {
+    ASSERT_TYPE(car(args), VECTOR);
+    ASSERT_TYPE(cadr(args), INTEGER);
+    if (integer_value(cadr(args)) < 0 ||
+        integer_value(cadr(args)) >= car(args)->vsize)
+        return NIL;
+    return car(args)->vector[integer_value(cadr(args))];
+}
+
+struct object *prim_vset(struct object *args) {
+    ASSERT_TYPE(car(args), VECTOR);
+    ASSERT_TYPE(cadr(args), INTEGER);
+    if (null(caddr(args)))
+        return NIL;
+    if (integer_value(cadr(args)) < 0 ||
+        integer_value(cadr(args)) >= car(args)->vsize)
+        return NIL;
+    gc_write_barrier(car(args), caddr(args));
+    car(args)->vector[integer_value(cadr(args))] = caddr(args);
+    return make_symbol("ok");
+}
+
+struct object *prim_vec(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    return make_vector(integer_value(car(args)));
+}
+
+/* (make-hash-table) compares keys with eq?, (make-hash-table equal?) with
+   equal? */
+struct object *prim_make_table(struct object *args) {
+    struct object *test = car(args);
+    if (!null(test) && (type_of(test) != PRIMITIVE ||
+                        (test->primitive != prim_eq &&
+                         test->primitive != prim_equal)))
+        error("make-hash-table: keys are compared with eq? or equal?");
+    return make_hash_table(!null(test) && test->primitive == prim_equal);
+}
+
+/* (hash-table-ref table key [default]), the default defaults to '() */
+struct object *prim_table_ref(struct object *args) {
+    ASSERT_TYPE(car(args), HASHTABLE);
+    struct object *table = car(args);
+    ssize_t pos = table_find(table, cadr(args),
+                             key_hash(cadr(args), table->equal));
+    if (pos < 0)
+        return caddr(args);
+    return table->entries[pos].value;
+}
+
+struct object *prim_table_set(struct object *args) {
+    ASSERT_TYPE(car(args), HASHTABLE);
+    gc_write_barrier(car(args), cadr(args));
+    gc_write_barrier(car(args), caddr(args));
+    table_set(car(args), cadr(args), caddr(args));
+    return make_symbol("ok");
+}
+
+struct object *prim_table_delete(struct object *args) {
+    ASSERT_TYPE(car(args), HASHTABLE);
+    table_delete(car(args), cadr(args));
+    return make_symbol("ok");
+}
+
+struct object *prim_table_count(struct object *args) {
+    ASSERT_TYPE(car(args), HASHTABLE);
+    return make_integer(car(args)->count);
+}
+
+/* the entries as a list of (key . value) pairs, in no particular order. The
+   table cannot change while the list is built, so it is safe to walk */
+struct object *prim_table_alist(struct object *args) {
+    struct object *table = car(args), *alist = NIL;
+    uint32_t i;
+    ASSERT_TYPE(table, HASHTABLE);
+    gc_frame();
+    gc_root(table);
+    gc_root(alist);
+    for (i = 0; i < table->capacity; i++)
+        if (table->entries[i].hash != 0)
+            alist = cons(cons(table->entries[i].key, table->entries[i].value),
+                         alist);
+    return alist;
+}
+
+struct object *prim_table_keys(struct object *args) {
+    struct object *table = car(args), *keys = NIL;
+    uint32_t i;
+    ASSERT_TYPE(table, HASHTABLE);
+    gc_frame();
+    gc_root(table);
+    gc_root(keys);
+    for (i = 0; i < table->capacity; i++)
+        if (table->entries[i].hash != 0)
+            keys = cons(table->entries[i].key, keys);
+    return keys;
+}
+
+struct object *prim_table_values(struct object *args) {
+    struct object *table = car(args), *values = NIL;
+    uint32_t i;
+    ASSERT_TYPE(table, HASHTABLE);
+    gc_frame();
+    gc_root(table);
+    gc_root(values);
+    for (i = 0; i < table->capacity; i++)
+        if (table->entries[i].hash != 0)
+            values = cons(table->entries[i].value, values);
+    return values;
+}
+
+struct object *prim_gc_objects_used(struct object *args) {
+    return make_integer(gc_objects_used);
+}
+
+struct object *prim_gc_pool_size(struct object *args) {
+    return make_integer(gc_pool_size);
+}
+
+struct object *prim_gc_total_alloc(struct object *args) {
+    return make_integer(gc_total_alloc);
+}
+
+struct object *prim_gc_pass(struct object *args) {
+    return make_integer(gc_pass());
+}
+
+struct object *prim_gc_max_pause(struct object *args) {
+    return make_integer(gc_max_pause_us);
+}
+
+struct object *prim_gc_pause_budget(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    gc_pause_budget_us = integer_value(car(args));
+    return make_integer(gc_pause_budget_us);
+}
+
+struct object *prim_gc_mark_threads(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    if (integer_value(car(args)) < 1 ||
+        integer_value(car(args)) > GC_MAX_MARK_THREADS)
+        error("gc-set-mark-threads: expected 1 to 64");
+    gc_mark_threads = integer_value(car(args));
+    return make_integer(gc_mark_threads);
+}
+
+struct object *prim_gc_background_sweep(struct object *args) {
+    gc_background_sweep = not_false(car(args));
+    return gc_background_sweep ? TRUE : FALSE;
+}
+
+struct object *prim_gc_nursery_bytes(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    if (integer_value(car(args)) <= 0)
+        error("gc-set-nursery-bytes: expected a positive size");
+    gc_nursery_bytes = integer_value(car(args));
+    return make_integer(gc_nursery_bytes);
+}
+
+struct object *prim_gc_target_live(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    if (integer_value(car(args)) <= 0 || integer_value(car(args)) > 100)
+        error("gc-set-target-live-percent: expected 1 to 100");
+    gc_target_live_pct = integer_value(car(args));
+    return make_integer(gc_target_live_pct);
+}
+
+struct object *prim_gc_shrink_slack(struct object *args) {
+    ASSERT_TYPE(car(args), INTEGER);
+    if (integer_value(car(args)) < 0)
+        error("gc-set-shrink-slack-percent: expected 0 or more");
+    gc_shrink_slack_pct = integer_value(car(args));
+    return make_integer(gc_shrink_slack_pct);
+}
+
+/* push (name . value) onto an association list */
+struct object *acons(char *name, struct object *value, struct object *alist) {
+    gc_frame();
+    gc_root(value);
+    gc_root(alist);
+    return cons(cons(make_symbol(name), value), alist);
+}
+
+struct object *prim_gc_stats(struct object *args) {
+    struct object *histogram = NIL, *freed = NIL, *stats = NIL;
+    int i;
+    gc_frame();
+    gc_root(histogram);
+    gc_root(freed);
+    gc_root(stats);
+    for (i = GC_PAUSE_BUCKETS - 1; i >= 0; i--)
+        histogram = cons(make_integer(GC_STATS.pause_histogram[i]), histogram);
+    for (i = HASHTABLE; i >= 0; i--)
+        freed = acons(TYPE_NAMES[i], make_integer(GC_STATS.freed[i]), freed);
+    stats = acons("slabs-freed", make_integer(GC_STATS.slabs_freed), stats);
+    stats =
+        acons("slabs-allocated", make_integer(GC_STATS.slabs_allocated), stats);
+    stats = acons("string-bytes", make_integer(GC_STATS.string_bytes), stats);
+    stats = acons("large-object-bytes", make_integer(GC_STATS.large_bytes),
+                  stats);
+    stats = acons("hash-table-bytes", make_integer(GC_STATS.table_bytes),
+                  stats);
+    stats = acons("vector-bytes", make_integer(GC_STATS.vector_bytes), stats);
+    stats = acons("total-allocated", make_integer(gc_total_alloc), stats);
+    stats = acons("pool-size", make_integer(gc_pool_size), stats);
+    stats = acons("objects-used", make_integer(gc_objects_used), stats);
+    stats = acons("freed", freed, stats);
+    stats = acons("pause-histogram", histogram, stats);
+    stats = acons("max-pause-us", make_integer(gc_max_pause_us), stats);
+    stats =
+        acons("total-pause-us", make_integer(GC_STATS.total_pause_us), stats);
+    stats = acons("pauses", make_integer(GC_STATS.pauses), stats);
+    stats = acons("full-collections", make_integer(GC_STATS.full), stats);
+    return acons("minor-collections", make_integer(GC_STATS.minor), stats);
+}
+
+/*==============================================================================
+  Environment handling
+  ==============================================================================*/
+
+struct object *extend_env(struct object *var, struct object *val,
+                          struct object *env) {
+    gc_frame();
+    gc_root(var);
+    gc_root(val);
+    gc_root(env);
+    return cons(cons(var, val), env);
+}
+
+/* find var in frame, leaving the cell that holds its value in *cell. The cell
+   is NIL where a procedure was given fewer arguments than it has parameters.
+   A global not defined yet is not found, though its cell is left if it has
+   one */
+bool frame_lookup(struct object *frame, struct object *var,
+                  struct object **cell) {
+    struct object *vars = car(frame);
+    struct object *vals = cdr(frame);
+    if (frame == GLOBAL_FRAME) {
+        ssize_t pos = table_find(GLOBALS, var, key_hash(var, false));
+        *cell = pos < 0 ? NIL : GLOBALS->entries[pos].value;
+        return pos >= 0 && (*cell)->car != UNBOUND;
+    }
+    while (!null(vars)) {
+        if (car(vars) == var) { // symbols are interned
+            *cell = vals;
+            return true;
+        }
+        vars = cdr(vars);
+        vals = cdr(vals);
+    }
+    return false;
+}
+
+/* the slot holding var's value in a vector frame, or 0 if it has none */
+int frame_slot(struct object *frame, struct object *var) {
+    struct object *names = frame->vector[0];
+    int i;
+    for (i = 1; is_pair(names) && i < frame->vsize; names = names->cdr, i++)
+        if (names->car == var)
+            return i;
+    return 0;
+}
+
+struct object *lookup_variable(struct object *var, struct object *env) {
+    struct object *cell;
+    int i;
+    for (; !null(env); env = cdr(env)) {
+        if (type_of(car(env)) == VECTOR) {
+            if ((i = frame_slot(car(env), var)) &&
+                car(env)->vector[i] != UNBOUND)
+                return car(env)->vector[i];
+        } else if (frame_lookup(car(env), var, &cell) &&
+                   car(cell) != UNBOUND) {
+            return car(cell);
+        }
+    }
+    return NIL;
+}
+
+/* set_variable binds var to val in the first frame in which var occurs, other
+   than as a name the body has not defined yet */
+void set_variable(struct object *var, struct object *val, struct object *env) {
+    struct object *cell;
+    int i;
+    for (; !null(env); env = cdr(env)) {
+        if (type_of(car(env)) == VECTOR) {
+            if ((i = frame_slot(car(env), var)) &&
+                car(env)->vector[i] != UNBOUND) {
+                gc_write_barrier(car(env), val);
+                car(env)->vector[i] = val;
+                return;
+            }
+        } else if (frame_lookup(car(env), var, &cell) &&
+                   car(cell) != UNBOUND) {
+            if (null(cell))
+                return;
+            gc_write_barrier(cell, val);
+            cell->car = val;
+            return;
+        }
+    }
+}
+
+/* bind var to val in a vector frame, which grows by a slot for a name its
+   body was not seen to define */
+struct object *define_slot(struct object *frame, struct object *var,
+                           struct object *val) {
+    int i = frame_slot(frame, var);
+    if (i == 0) {
+        gc_frame();
+        gc_root(frame);
+        gc_root(var);
+        gc_root(val);
+        struct object *names = append(frame->vector[0], cons(var, NIL));
+        size_t bytes = sizeof(struct object *) * frame->vsize;
+        struct object **slots =
+            alloc_payload(frame, bytes + sizeof(struct object *));
+        memcpy(slots, frame->vector, bytes);
+        free_payload(frame->vector, bytes);
+        frame->vector = slots;
+        i = frame->vsize++;
+        GC_STATS.vector_bytes += sizeof(struct object *);
+        gc_young_bytes += bytes + sizeof(struct object *);
+        profile_bytes(VECTOR, bytes + sizeof(struct object *));
+        gc_write_barrier(frame, names);
+        frame->vector[0] = names;
+    }
+    gc_write_barrier(frame, val);
+    frame->vector[i] = val;
+    return val;
+}
+
+/* define_variable binds var to val in the *current* frame */
+struct object *define_variable(struct object *var, struct object *val,
+                               struct object *env) {
+    struct object *frame = car(env);
+    struct object *vars, *vals;
+    if (type_of(frame) == VECTOR)
+        return define_slot(frame, var, val);
+    if (frame_lookup(frame, var, &vals) && !null(vals)) {
+        gc_write_barrier(vals, val);
+        vals->car = val;
+        return val;
+    }
+    gc_frame();
+    gc_root(var);
+    gc_root(val);
+    gc_root(env);
+    gc_root(frame);
+    vars = cons(var, car(frame));
+    gc_write_barrier(frame, vars);
+    frame->car = vars;
+    if (frame == GLOBAL_FRAME && !null(vals)) {
+        /* referred to before it was defined, it has a cell already */
+        gc_write_barrier(vals, val);
+        vals->car = val;
+        gc_write_barrier(vals, cdr(frame));
+        vals->cdr = cdr(frame);
+        gc_write_barrier(frame, vals);
+        frame->cdr = vals;
+        return val;
+    }
+    vals = cons(val, cdr(frame));
+    gc_write_barrier(frame, vals);
+    frame->cdr = vals;
+    if (frame == GLOBAL_FRAME) {
+        gc_write_barrier(GLOBALS, var);
+        gc_write_barrier(GLOBALS, vals);
+        table_set(GLOBALS, var, vals);
+    }
+    return val;
+}
+
+/*==============================================================================
+  Syntactic analysis
+  ==============================================================================*/
+/* Each top level form is analyzed once into a tree of nodes, which execute()
+   then runs without looking at the form again. A node is a pair of its opcode,
+   a fixnum, and its operands:
+
+     (CONST . value)                     (IF test then . else)
+     (LOCAL name depth . slot)           (SEQUENCE . nodes)
+     (GLOBAL name . cell)                (COND (test . sequence) ...)
+     (NAME . symbol)                     (LAMBDA . code)
+     (SET_LOCAL (depth . slot) . value)  (LET code . values)
+     (SET_NAME symbol . value)           (CALL exp operator . operands)
+     (DEFINE symbol . value)             (DEFINE_LOCAL slot . value)
+
+   Variables are resolved as they are analyzed: a local one to a slot of the
+   frame depth frames up from the current one, a global one to the cell holding
+   its value in the global frame. Anything else, such as a global of an
+   environment set with set-global-environment, is looked up by NAME.
+
+   A frame is a vector with its names in slot 0 and their values from slot 1
+   on, those the body defines followed by the parameters, so that every name
+   has the same slot in each call. Until its definition has run, the slot of a
+   name the body defines holds UNBOUND, and the name is looked up and set
+   further out, as eval does. The code of a procedure or let body is a vector
+   of the CODE_ fields below, which a closure keeps after its environment,
+   paired with that environment. A closure whose parameters, body or
+   environment are changed, as mutate-procedure-* do, or one made by eval, is
+   applied by eval. Quoted data is left alone, as is code put together at run
+   time, which eval looks up by name in list frames as before */
+
+enum opcode {
+    OP_CONST,
+    OP_LOCAL,
+    OP_GLOBAL,
+    OP_NAME,
+    OP_SET_LOCAL,
+    OP_SET_NAME,
+    OP_DEFINE,
+    OP_DEFINE_LOCAL,
+    OP_IF,
+    OP_SEQUENCE,
+    OP_COND,
+    OP_LAMBDA,
+    OP_LET,
+    OP_CALL
+};
+
+enum code_field {
+    CODE_PARAMS,   // the parameters and body it was analyzed from
+    CODE_BODY,
+    CODE_NAMES,    // slot 0 of its frames
+    CODE_FIRST,    // the slot of the first parameter
+    CODE_SLOTS,    // the size of its frames
+    CODE_NODE,     // the body's sequence node
+    CODE_BYTECODE, // the same compiled, once the VM has called it
+    CODE_FIELDS
+};
+
+#define make_node(op, operands) (cons(make_integer(op), (operands)))
+#define node_op(node) ((enum opcode)integer_value((node)->car))
+
+bool has_name(struct object *names, struct object *name) {
+    for (; is_pair(names); names = names->cdr)
+        if (names->car == name)
+            return true;
+    return false;
+}
+
+/* the names exp defines in the frame it is evaluated in, added to frame */
+struct object *frame_defines(struct object *exp, struct object *frame) {
+    struct object *name;
+    gc_frame();
+    gc_root(exp);
+    gc_root(frame);
+    if (!is_pair(exp) || is_tagged(exp, QUOTE) || is_tagged(exp, LAMBDA))
+        return frame;
+    if (is_tagged(exp, DEFINE) || (is_tagged(exp, LET) && atom(cadr(exp)))) {
+        name = atom(cadr(exp)) ? cadr(exp) : car(cadr(exp));
+        if (!has_name(frame, name))
+            frame = cons(name, frame);
+        /* a function definition's body is a frame of its own, as is a named
+           let's, though its starting values are not */
+        if (is_tagged(exp, DEFINE))
+            return atom(cadr(exp)) ? frame_defines(caddr(exp), frame) : frame;
+        for (exp = caddr(exp); is_pair(exp); exp = cdr(exp))
+            frame = frame_defines(cadar(exp), frame);
+        return frame;
+    }
+    if (is_tagged(exp, LET)) {
+        for (exp = cadr(exp); is_pair(exp); exp = cdr(exp))
+            frame = frame_defines(cadar(exp), frame);
+        return frame;
+    }
+    if (is_tagged(exp, SET) && !atom(cadr(exp)))
+        return frame;
+    for (; is_pair(exp); exp = cdr(exp))
+        frame = frame_defines(car(exp), frame);
+    return frame;
 }
-struct object *prim_gt(void *workspace, struct object *sexp) {
-    ASSERT_TYPE(car(sexp), INTEGER);
-    ASSERT_TYPE(cadr(sexp), INTEGER);
-    return (car(sexp)->integer > cadr(sexp)->integer) ? TRUE : NIL;
+
+/* the (depth . slot) of var from within scope, a list of the frames' names, or
+   NULL if it is not a local variable */
+struct object *local_place(struct object *var, struct object *scope) {
+    struct object *names;
+    int64_t depth = 0, slot;
+    for (; !null(scope); scope = cdr(scope), depth++) {
+        slot = 1;
+        for (names = car(scope); is_pair(names); names = cdr(names), slot++)
+            if (car(names) == var)
+                return cons(make_integer(depth), make_integer(slot));
+    }
+    return NULL;
 }
 
-struct object *prim_lt(void *workspace, struct object *sexp) {
-    ASSERT_TYPE(car(sexp), INTEGER);
-    ASSERT_TYPE(cadr(sexp), INTEGER);
-    return (car(sexp)->integer < cadr(sexp)->integer) ? TRUE : NIL;
+struct object *analyze_variable(struct object *var, struct object *scope) {
+    struct object *names, *vals = NULL;
+    gc_frame();
+    gc_root(var);
+    gc_root(vals);
+    if ((vals = local_place(var, scope)) != NULL)
+        return make_node(OP_LOCAL, cons(var, vals));
+    if (type_of(car(ENV)) != VECTOR && frame_lookup(car(ENV), var, &vals) &&
+        !null(vals))
+        return make_node(OP_GLOBAL, cons(var, vals));
+    /* found further out, in an environment set with set-global-environment, a
+       definition at the top level could still shadow it. A procedure's frame
+       made the global one has no cells to refer to */
+    for (names = ENV; !null(names); names = cdr(names)) {
+        struct object *frame = car(names);
+        if (type_of(frame) == VECTOR ? frame_slot(frame, var) > 0
+                                     : frame_lookup(frame, var, &vals))
+            return make_node(OP_NAME, var);
+    }
+    if (car(ENV) != GLOBAL_FRAME)
+        return make_node(OP_NAME, var);
+    /* a global not defined yet is given a cell holding UNBOUND, and its name
+       for load_image, which define_variable puts in the global frame once it
+       is defined */
+    frame_lookup(GLOBAL_FRAME, var, &vals);
+    if (null(vals)) {
+        vals = cons(UNBOUND, var);
+        gc_write_barrier(GLOBALS, var);
+        gc_write_barrier(GLOBALS, vals);
+        table_set(GLOBALS, var, vals);
+    }
+    return make_node(OP_GLOBAL, cons(var, vals));
 }
 
-struct object *prim_print(void *workspace, struct object *args) {
-    print_exp(NULL, car(args));
+/* the value of a variable found unbound */
+static struct object *unbound(struct object *var) {
+#ifdef STRICT
+    print_exp("Unbound symbol:", var);
     printf("\n");
+#else
+    (void)var;
+#endif
     return NIL;
 }
 
-struct object *prim_exit(void *workspace, struct object *args) {
-    exit(0);
+/* the value of a global from its (name . cell) */
+static inline struct object *global_value(struct object *global) {
+    struct object *val = global->cdr->car;
+    return val == UNBOUND ? unbound(global->car) : val;
 }
 
-struct object *prim_read(void *workspace, struct object *args) {
-    return read_exp(workspace, stdin);
+/* define or set! var to the value of node. Names a body defines have a slot in
+   its frame, globals are set by name, which leaves setting one never defined
+   alone */
+struct object *analyze_assignment(bool define, struct object *var,
+                                  struct object *node, struct object *scope) {
+    struct object *place = NULL;
+    gc_frame();
+    gc_root(var);
+    gc_root(node);
+    gc_root(place);
+    place = local_place(var, scope);
+    if (place != NULL && !define)
+        return make_node(OP_SET_LOCAL, cons(place, node));
+    if (place != NULL && integer_value(car(place)) == 0)
+        return make_node(OP_DEFINE_LOCAL, cons(cdr(place), node));
+    return make_node(define ? OP_DEFINE : OP_SET_NAME, cons(var, node));
 }
 
-struct object *prim_vget(void *workspace, struct object *args) {
-    ASSERT_TYPE(car(args), VECTOR);
-    ASSERT_TYPE(cadr(args), INTEGER);
-    if (cadr(args)->integer >= car(args)->vsize)
+struct object *analyze(struct object *exp, struct object *scope);
+
+struct object *analyze_list(struct object *exps, struct object *scope) {
+    if (!is_pair(exps))
         return NIL;
-    return car(args)->vector[cadr(args)->integer];
+    gc_frame();
+    gc_root(exps);
+    gc_root(scope);
+    struct object *node = analyze(exps->car, scope);
+    gc_root(node);
+    return cons(node, analyze_list(exps->cdr, scope));
 }
 
-struct object *prim_vset(void *workspace, struct object *args) {
-    ASSERT_TYPE(car(args), VECTOR);
-    ASSERT_TYPE(cadr(args), INTEGER);
-    if (null(caddr(args)))
+struct object *analyze_clauses(struct object *clauses, struct object *scope) {
+    struct object *test = NULL, *body = NULL;
+    if (!is_pair(clauses))
         return NIL;
-    if (cadr(args)->integer >= car(args)->vsize)
-        return NIL;
-    car(args)->vector[cadr(args)->integer] = caddr(args);
-    return make_symbol(workspace, "ok");
+    gc_frame();
+    gc_root(clauses);
+    gc_root(scope);
+    gc_root(test);
+    gc_root(body);
+    if (is_tagged(car(clauses), ELSE))
+        test = make_node(OP_CONST, TRUE);
+    else
+        test = analyze(caar(clauses), scope);
+    body = make_node(OP_SEQUENCE, analyze_list(cdar(clauses), scope));
+    body = cons(test, body);
+    return cons(body, analyze_clauses(cdr(clauses), scope));
 }
 
-struct object *prim_vec(void *workspace, struct object *args) {
-    ASSERT_TYPE(car(args), INTEGER);
-    return make_vector(workspace, car(args)->integer);
+static inline void code_set(struct object *code, enum code_field field,
+                            struct object *val) {
+    gc_write_barrier(code, val);
+    code->vector[field] = val;
 }
 
-struct object *prim_gc_objects_used(void *workspace, struct object *args) {
-    return make_integer(workspace, gc_objects_used);
+/* the code of a body with a frame of its own holding the given parameters */
+struct object *analyze_body(struct object *params, struct object *body,
+                            struct object *scope) {
+    struct object *names = params, *code = NULL, *rest;
+    int64_t first = 0, slots = 0;
+    gc_frame();
+    gc_root(params);
+    gc_root(body);
+    gc_root(scope);
+    gc_root(names);
+    gc_root(code);
+    for (rest = body; is_pair(rest); rest = rest->cdr)
+        names = frame_defines(rest->car, names);
+    for (rest = names; is_pair(rest); rest = rest->cdr, slots++)
+        if (rest == params)
+            first = slots;
+    if (!is_pair(params))
+        first = slots;
+    code = make_vector(CODE_FIELDS);
+    code_set(code, CODE_PARAMS, params);
+    code_set(code, CODE_BODY, body);
+    code_set(code, CODE_NAMES, names);
+    code_set(code, CODE_FIRST, make_integer(first + 1));
+    code_set(code, CODE_SLOTS, make_integer(slots + 1));
+    scope = cons(names, scope);
+    code_set(code, CODE_NODE,
+             make_node(OP_SEQUENCE, analyze_list(body, scope)));
+    return code;
 }
 
-struct object *prim_gc_pool_size(void *workspace, struct object *args) {
-    return make_integer(workspace, gc_pool_size);
+/* the node for exp, whose frames' names make up scope */
+struct object *analyze(struct object *exp, struct object *scope) {
+    struct object *vars = NIL, *vals = NIL, *node = NULL, *code = NULL;
+    enum special_form form = special_form(exp);
+    gc_frame();
+    gc_root(exp);
+    gc_root(scope);
+    gc_root(vars);
+    gc_root(vals);
+    gc_root(node);
+    gc_root(code);
+    if (!null(exp) && type_of(exp) == SYMBOL)
+        return analyze_variable(exp, scope);
+    if (!is_pair(exp))
+        return make_node(OP_CONST, exp);
+    switch (form) {
+    case FORM_QUOTE:
+        return make_node(OP_CONST, cadr(exp));
+    case FORM_LAMBDA:
+        return make_node(OP_LAMBDA, analyze_body(cadr(exp), cddr(exp), scope));
+    case FORM_DEFINE:
+    case FORM_SET:
+        if (atom(cadr(exp))) {
+            node = analyze(caddr(exp), scope);
+            return analyze_assignment(form == FORM_DEFINE, cadr(exp), node,
+                                      scope);
+        }
+        code = analyze_body(cdr(cadr(exp)), cddr(exp), scope);
+        node = make_node(OP_LAMBDA, code);
+        return analyze_assignment(form == FORM_DEFINE, car(cadr(exp)), node,
+                                  scope);
+    case FORM_BEGIN:
+        return make_node(OP_SEQUENCE, analyze_list(cdr(exp), scope));
+    case FORM_IF:
+    case FORM_OR: // takes the branches of an if, as eval has it
+        vals = analyze(cadddr(exp), scope);
+        node = analyze(caddr(exp), scope);
+        vals = cons(node, vals);
+        node = analyze(cadr(exp), scope);
+        return make_node(OP_IF, cons(node, vals));
+    case FORM_COND:
+        return make_node(OP_COND, analyze_clauses(cdr(exp), scope));
+    case FORM_LET:
+        if (null(cadr(exp)))
+            return make_node(OP_CONST, NIL);
+        /* let binds its variables in the reverse of the order they are given,
+           and runs its body in a frame of its own */
+        node = atom(cadr(exp)) ? caddr(exp) : cadr(exp);
+        for (; is_pair(node); node = cdr(node)) {
+            vars = cons(caar(node), vars);
+            vals = cons(cadar(node), vals);
+        }
+        if (!atom(cadr(exp))) {
+            code = analyze_body(vars, cddr(exp), scope);
+            return make_node(OP_LET, cons(code, analyze_list(vals, scope)));
+        }
+        /* a named let defines its procedure, then calls it with the starting
+           values */
+        code = analyze_body(vars, cdr(cddr(exp)), scope);
+        node = make_node(OP_LAMBDA, code);
+        code = analyze_assignment(true, cadr(exp), node, scope);
+        node = analyze_variable(cadr(exp), scope);
+        node = cons(node, analyze_list(vals, scope));
+        node = make_node(OP_CALL, cons(cons(cadr(exp), vals), node));
+        return make_node(OP_SEQUENCE, cons(code, cons(node, NIL)));
+    case NOT_SPECIAL:
+        break;
+    }
+    node = analyze(car(exp), scope);
+    node = cons(node, analyze_list(cdr(exp), scope));
+    return make_node(OP_CALL, cons(exp, node));
 }
 
-struct object *prim_gc_total_alloc(void *workspace, struct object *args) {
-    return make_integer(workspace, gc_total_alloc);
+/* the name in slot of a vector frame */
+static struct object *slot_name(struct object *frame, int64_t slot) {
+    struct object *names = frame->vector[0];
+    for (; slot > 1; slot--)
+        names = names->cdr;
+    return names->car;
 }
 
-struct object *prim_gc_pass(void *workspace, struct object *args) {
-    return make_integer(workspace, gc_pass(workspace));
+/* the value of the name in slot of the first frame of env, which its body has
+   not defined yet, from further out */
+static struct object *lookup_outer(struct object *env, int64_t slot) {
+    struct object *var = slot_name(env->car, slot);
+    struct object *val = lookup_variable(var, env->cdr);
+    return null(val) ? unbound(var) : val;
 }
 
-/*==============================================================================
-  Environment handling
-  ==============================================================================*/
-
-struct object *extend_env(void *workspace, struct object *var,
-                          struct object *val, struct object *env) {
-    create_workspace(3);
-    set_local(0, var);
-    set_local(1, val);
-    set_local(2, env);
-    return cons(workspace, cons(workspace, var, val), env);
+/* the value of a variable, from further out while the body has not defined it
+   yet. For a frame not made from code it is '() */
+static inline struct object *lookup_local(struct object *place,
+                                          struct object *env) {
+    int64_t depth = integer_value(place->car);
+    int64_t slot = integer_value(place->cdr);
+    for (; depth > 0; depth--)
+        env = env->cdr;
+    struct object *frame = env->car;
+    if (type_of(frame) != VECTOR || slot >= frame->vsize)
+        return NIL;
+    if (frame->vector[slot] == UNBOUND)
+        return lookup_outer(env, slot);
+    return frame->vector[slot];
 }
 
-struct object *lookup_variable(struct object *var, struct object *env) {
-    while (!null(env)) {
-        struct object *frame = car(env);
-        struct object *vars = car(frame);
-        struct object *vals = cdr(frame);
-        while (!null(vars)) {
-            if (is_equal(car(vars), var))
-                return car(vals);
-            vars = cdr(vars);
-            vals = cdr(vals);
-        }
-        env = cdr(env);
+void set_local(struct object *place, struct object *val, struct object *env) {
+    int64_t depth = integer_value(place->car);
+    int64_t slot = integer_value(place->cdr);
+    for (; depth > 0; depth--)
+        env = env->cdr;
+    struct object *frame = env->car;
+    if (type_of(frame) != VECTOR || slot >= frame->vsize)
+        return;
+    if (frame->vector[slot] == UNBOUND) {
+        set_variable(slot_name(frame, slot), val, env->cdr);
+        return;
     }
-    return NIL;
+    gc_write_barrier(frame, val);
+    frame->vector[slot] = val;
 }
 
-/* set_variable binds var to val in the first frame in which var occurs */
-void set_variable(struct object *var, struct object *val, struct object *env) {
-    while (!null(env)) {
-        struct object *frame = car(env);
-        struct object *vars = car(frame);
-        struct object *vals = cdr(frame);
-        while (!null(vars)) {
-            if (is_equal(car(vars), var)) {
-                vals->car = val;
-                return;
-            }
-            vars = cdr(vars);
-            vals = cdr(vals);
-        }
-        env = cdr(env);
-    }
+/* bind the name in slot of the current frame to val */
+void define_local(struct object *slot, struct object *val,
+                  struct object *env) {
+    struct object *frame = env->car;
+    if (type_of(frame) != VECTOR || integer_value(slot) >= frame->vsize)
+        return;
+    gc_write_barrier(frame, val);
+    frame->vector[integer_value(slot)] = val;
 }
 
-/* define_variable binds var to val in the *current* frame */
-struct object *define_variable(void *workspace, struct object *var,
-                               struct object *val, struct object *env) {
-    struct object *frame = car(env);
-    struct object *vars = car(frame);
-    struct object *vals = cdr(frame);
-    while (!null(vars)) {
-        if (is_equal(var, car(vars))) {
-            vals->car = val;
-            return val;
-        }
-        vars = cdr(vars);
-        vals = cdr(vals);
-    }
-    create_workspace(3);
-    set_local(0, var);
-    set_local(1, val);
-    set_local(2, env);
-    frame->car = cons(workspace, var, car(frame));
-    frame->cdr = cons(workspace, val, cdr(frame));
-    return val;
+/* (procedure params body env (code . env)), the code kept with the
+   environment it was made in */
+struct object *make_closure(struct object *code, struct object *env) {
+    gc_frame();
+    gc_root(code);
+    gc_root(env);
+    struct object *closure = cons(code, env);
+    gc_root(closure);
+    closure = cons(env, cons(closure, EMPTY_LIST));
+    closure = cons(code->vector[CODE_BODY], closure);
+    closure = cons(code->vector[CODE_PARAMS], closure);
+    return cons(PROCEDURE, closure);
+}
+
+/* the code of a closure, unless it has none or its parameters, body or
+   environment have been changed since it was made */
+static inline struct object *closure_code(struct object *proc) {
+    if (!is_tagged(proc, PROCEDURE))
+        return NULL;
+    struct object *params = cadr(proc), *body = caddr(proc);
+    struct object *env = cadddr(proc), *made = car(cddr(cddr(proc)));
+    if (!is_pair(made) || made->cdr != env)
+        return NULL;
+    struct object *code = made->car;
+    if (null(code) || type_of(code) != VECTOR || code->vsize != CODE_FIELDS ||
+        code->vector[CODE_PARAMS] != params || code->vector[CODE_BODY] != body)
+        return NULL;
+    return code;
 }
 
 /*==============================================================================
@@ -805,24 +2977,25 @@ void skip(FILE *in) {
     }
 }
 
-struct object *read_string(void *workspace, FILE *in) {
-    char buf[256];
-    int i = 0;
+struct object *read_string(FILE *in) {
+    size_t size = 32;
+    size_t i = 0;
+    char *buf = malloc(size);
     int c;
     while ((c = getc(in)) != '\"') {
-        if (c == EOF)
+        if (c == EOF) {
+            free(buf);
             return NIL;
-        if (i >= 256)
-            error("String too long - maximum length 256 characters");
+        }
+        if (i + 1 >= size)
+            buf = realloc(buf, size <<= 1);
         buf[i++] = (char)c;
     }
     buf[i] = '\0';
-    struct object *s = make_symbol(workspace, buf);
-    s->type = STRING;
-    return s;
+    return make_string(buf, i);
 }
 
-struct object *read_symbol(void *workspace, FILE *in, char start) {
+struct object *read_symbol(FILE *in, char start) {
     char buf[128];
     buf[0] = start;
     int i = 1;
@@ -832,38 +3005,37 @@ struct object *read_symbol(void *workspace, FILE *in, char start) {
         buf[i++] = getc(in);
     }
     buf[i] = '\0';
-    return make_symbol(workspace, buf);
+    return make_symbol(buf);
 }
 
-int read_int(FILE *in, int start) {
+int64_t read_int(FILE *in, int64_t start) {
     while (isdigit(peek(in)))
         start = start * 10 + (getc(in) - '0');
     return start;
 }
 
-struct object *read_list(void *workspace, FILE *in) {
+struct object *read_list(FILE *in) {
     struct object *obj = NULL;
     struct object *cell = EMPTY_LIST;
-    create_workspace(2);
-    set_local(0, obj);
-    set_local(1, cell);
+    gc_frame();
+    gc_root(obj);
+    gc_root(cell);
     for (;;) {
-        obj = read_exp(workspace, in);
+        obj = read_exp(in);
         if (obj == EMPTY_LIST)
-            return reverse(workspace, cell, EMPTY_LIST);
-        cell = cons(workspace, obj, cell);
+            return reverse(cell, EMPTY_LIST);
+        cell = cons(obj, cell);
     }
     return EMPTY_LIST;
 }
 
-struct object *read_quote(void *workspace, FILE *in) {
-    return cons(workspace, QUOTE,
-                cons(workspace, read_exp(workspace, in), NIL));
+struct object *read_quote(FILE *in) {
+    return cons(QUOTE, cons(read_exp(in), NIL));
 }
 
 int depth = 0;
 
-struct object *read_exp(void *workspace, FILE *in) {
+struct object *read_exp(FILE *in) {
     int c;
 
     for (;;) {
@@ -883,23 +3055,23 @@ struct object *read_exp(void *workspace, FILE *in) {
         if (c == EOF)
             return NULL;
         if (c == '\"')
-            return read_string(workspace, in);
+            return read_string(in);
         if (c == '\'')
-            return read_quote(workspace, in);
+            return read_quote(in);
         if (c == '(') {
             depth++;
-            return read_list(workspace, in);
+            return read_list(in);
         }
         if (c == ')') {
             depth--;
             return EMPTY_LIST;
         }
         if (isdigit(c))
-            return make_integer(workspace, read_int(in, c - '0'));
+            return make_integer(read_int(in, c - '0'));
         if (c == '-' && isdigit(peek(in)))
-            return make_integer(workspace, -1 * read_int(in, getc(in) - '0'));
+            return make_integer(-1 * read_int(in, getc(in) - '0'));
         if (isalpha(c) || strchr(SYMBOLS, c))
-            return read_symbol(workspace, in, c);
+            return read_symbol(in, c);
     }
     return NIL;
 }
@@ -911,7 +3083,7 @@ void print_exp(char *str, struct object *e) {
         printf("'()");
         return;
     }
-    switch (e->type) {
+    switch (type_of(e)) {
     case STRING:
         printf("\"%s\"", e->string);
         break;
@@ -919,7 +3091,7 @@ void print_exp(char *str, struct object *e) {
         printf("%s", e->string);
         break;
     case INTEGER:
-        printf("%ld", e->integer);
+        printf("%ld", integer_value(e));
         break;
     case PRIMITIVE:
         printf("<function>");
@@ -927,6 +3099,9 @@ void print_exp(char *str, struct object *e) {
     case VECTOR:
         printf("<vector %d>", e->vsize);
         break;
+    case HASHTABLE:
+        printf("<hashtable %u>", e->count);
+        break;
     case LIST:
         if (is_tagged(e, PROCEDURE)) {
             printf("<closure>");
@@ -938,7 +3113,7 @@ void print_exp(char *str, struct object *e) {
             print_exp(NULL, (*t)->car);
             if (!null((*t)->cdr)) {
                 printf(" ");
-                if ((*t)->cdr->type == LIST) {
+                if (type_of((*t)->cdr) == LIST) {
                     t = &(*t)->cdr;
                 } else {
                     print_exp(".", (*t)->cdr);
@@ -955,138 +3130,133 @@ void print_exp(char *str, struct object *e) {
   LISP evaluator
   ==============================================================================*/
 
-struct object *evlis(void *workspace, struct object *exp, struct object *env) {
+struct object *evlis(struct object *exp, struct object *env) {
     if (null(exp))
         return NIL;
-    create_workspace(3);
-    set_local(0, exp);
-    set_local(1, env);
-    struct object *tmp = eval(workspace, car(exp), env);
-    set_local(2, tmp);
-    return cons(workspace, tmp, evlis(workspace, cdr(exp), env));
+    gc_frame();
+    gc_root(exp);
+    gc_root(env);
+    struct object *tmp = eval(car(exp), env);
+    gc_root(tmp);
+    return cons(tmp, evlis(cdr(exp), env));
 }
 
-struct object *eval_sequence(void *workspace, struct object *exps,
-                             struct object *env) {
+struct object *eval_sequence(struct object *exps, struct object *env) {
     if (null(cdr(exps)))
-        return eval(workspace, car(exps), env);
-    create_workspace(2);
-    set_local(0, exps);
-    set_local(1, env);
-    eval(workspace, car(exps), env);
-    return eval_sequence(workspace, cdr(exps), env);
-}
-
-struct object *eval(void *workspace, struct object *exp, struct object *env) {
-    create_workspace(6);
-    set_local(0, exp);
-    set_local(1, env);
+        return eval(car(exps), env);
+    gc_frame();
+    gc_root(exps);
+    gc_root(env);
+    eval(car(exps), env);
+    return eval_sequence(cdr(exps), env);
+}
+
+struct object *eval(struct object *exp, struct object *env) {
+    gc_frame();
+    gc_root(exp);
+    gc_root(env);
+    profile_frame();
 tail:
     if (null(exp) || exp == EMPTY_LIST) {
         return NIL;
-    } else if (exp->type == INTEGER || exp->type == STRING) {
+    } else if (type_of(exp) == INTEGER || type_of(exp) == STRING) {
         return exp;
-    } else if (exp->type == SYMBOL) {
+    } else if (type_of(exp) == SYMBOL) {
         struct object *s = lookup_variable(exp, env);
-#ifdef STRICT
-        if (null(s)) {
-            print_exp("Unbound symbol:", exp);
-            printf("\n");
-        }
-#endif
-        return s;
-    } else if (is_tagged(exp, QUOTE)) {
+        return null(s) ? unbound(exp) : s;
+    }
+    switch (special_form(exp)) {
+    case FORM_QUOTE:
         return cadr(exp);
-    } else if (is_tagged(exp, LAMBDA)) {
-        return make_procedure(workspace, cadr(exp), cddr(exp), env);
-    } else if (is_tagged(exp, DEFINE)) {
+    case FORM_LAMBDA:
+        return make_procedure(cadr(exp), cddr(exp), env);
+    case FORM_DEFINE:
         if (atom(cadr(exp))) {
-            define_variable(workspace, cadr(exp),
-                            eval(workspace, caddr(exp), env), env);
+            define_variable(cadr(exp), eval(caddr(exp), env), env);
         } else {
             struct object *closure =
-                eval(workspace,
-                     make_lambda(workspace, cdr(cadr(exp)), cddr(exp)), env);
-            define_variable(workspace, car(cadr(exp)), closure, env);
+                eval(make_lambda(cdr(cadr(exp)), cddr(exp)), env);
+            define_variable(car(cadr(exp)), closure, env);
         }
-        return make_symbol(workspace, "ok");
-    } else if (is_tagged(exp, BEGIN)) {
+        return make_symbol("ok");
+    case FORM_BEGIN: {
         struct object *args = cdr(exp);
-        set_local(2, args);
+        gc_frame();
+        gc_root(args);
         for (; !null(cdr(args)); args = cdr(args))
-            eval(workspace, car(args), env);
+            eval(car(args), env);
         exp = car(args);
         goto tail;
-    } else if (is_tagged(exp, IF)) {
-        struct object *predicate = eval(workspace, cadr(exp), env);
-        exp = (not_false(predicate)) ? caddr(exp) : cadddr(exp);
-        goto tail;
-    } else if (is_tagged(exp, make_symbol(workspace, "or"))) {
-        struct object *predicate = eval(workspace, cadr(exp), env);
+    }
+    case FORM_IF:
+    case FORM_OR: {
+        struct object *predicate = eval(cadr(exp), env);
         exp = (not_false(predicate)) ? caddr(exp) : cadddr(exp);
         goto tail;
-    } else if (is_tagged(exp, make_symbol(workspace, "cond"))) {
+    }
+    case FORM_COND: {
         struct object *branch = cdr(exp);
-        set_local(2, branch);
+        gc_frame();
+        gc_root(branch);
         for (; !null(branch); branch = cdr(branch)) {
-            if (is_tagged(car(branch), make_symbol(workspace, "else")) ||
-                not_false(eval(workspace, caar(branch), env))) {
-                exp = cons(workspace, BEGIN, cdar(branch));
+            if (is_tagged(car(branch), ELSE) ||
+                not_false(eval(caar(branch), env))) {
+                exp = cons(BEGIN, cdar(branch));
                 goto tail;
             }
         }
         return NIL;
-    } else if (is_tagged(exp, SET)) {
+    }
+    case FORM_SET:
         if (atom(cadr(exp)))
-            set_variable(cadr(exp), eval(workspace, caddr(exp), env), env);
+            set_variable(cadr(exp), eval(caddr(exp), env), env);
         else {
             struct object *closure =
-                eval(workspace,
-                     make_lambda(workspace, cdr(cadr(exp)), cddr(exp)), env);
+                eval(make_lambda(cdr(cadr(exp)), cddr(exp)), env);
             set_variable(car(cadr(exp)), closure, env);
         }
-        return make_symbol(workspace, "ok");
-    } else if (is_tagged(exp, LET)) {
+        return make_symbol("ok");
+    case FORM_LET: {
         /* We go with the strategy of transforming let into a lambda function*/
         struct object **tmp;
         struct object *vars = NIL;
         struct object *vals = NIL;
-        set_local(2, vars);
-        set_local(3, vals);
+        gc_frame();
+        gc_root(vars);
+        gc_root(vals);
         if (null(cadr(exp)))
             return NIL;
         /* NAMED LET */
         if (atom(cadr(exp))) {
             for (tmp = &exp->cdr->cdr->car; !null(*tmp); tmp = &(*tmp)->cdr) {
-                set_local(4, *tmp);
-                vars = cons(workspace, caar(*tmp), vars);
-                vals = cons(workspace, cadar(*tmp), vals);
+                vars = cons(caar(*tmp), vars);
+                vals = cons(cadar(*tmp), vals);
             }
             /* Define the named let as a lambda function */
-            struct object *lambda =
-                make_lambda(workspace, vars, cdr(cddr(exp)));
-            set_local(4, lambda);
-            struct object *new_env = extend_env(workspace, vars, vals, env);
-            set_local(5, new_env);
-            define_variable(workspace, cadr(exp),
-                            eval(workspace, lambda, new_env), env);
+            struct object *lambda = make_lambda(vars, cdr(cddr(exp)));
+            gc_root(lambda);
+            struct object *new_env = extend_env(vars, vals, env);
+            gc_root(new_env);
+            define_variable(cadr(exp), eval(lambda, new_env), env);
             /* Then evaluate the lambda function with the starting values */
-            exp = cons(workspace, cadr(exp), vals);
+            exp = cons(cadr(exp), vals);
             goto tail;
         }
         for (tmp = &exp->cdr->car; !null(*tmp); tmp = &(*tmp)->cdr) {
-            vars = cons(workspace, caar(*tmp), vars);
-            vals = cons(workspace, cadar(*tmp), vals);
+            vars = cons(caar(*tmp), vars);
+            vals = cons(cadar(*tmp), vals);
         }
-        exp = cons(workspace, make_lambda(workspace, vars, cddr(exp)), vals);
+        exp = cons(make_lambda(vars, cddr(exp)), vals);
         goto tail;
-    } else {
+    }
+    case NOT_SPECIAL: {
         /* procedure structure is as follows:
            ('procedure, (parameters), (body), (env)) */
-        struct object *proc = eval(workspace, car(exp), env);
-        set_local(2, proc);
-        struct object *args = evlis(workspace, cdr(exp), env);
-        set_local(3, args);
+        struct object *proc = eval(car(exp), env);
+        gc_frame();
+        gc_root(proc);
+        struct object *args = evlis(cdr(exp), env);
+        gc_root(args);
         if (null(proc)) {
 #ifdef STRICT
             print_exp("Invalid arguments to eval:", exp);
@@ -1095,27 +3265,584 @@ tail:
 
             return NIL;
         }
-        if (proc->type == PRIMITIVE)
-            return proc->primitive(workspace, args);
+        if (type_of(proc) == PRIMITIVE)
+            return proc->primitive(args);
         if (is_tagged(proc, PROCEDURE)) {
-            env = extend_env(workspace, cadr(proc), args, cadddr(proc));
-            exp = cons(workspace, BEGIN, caddr(proc)); /* procedure body */
+            profile_enter(car(exp));
+            env = extend_env(cadr(proc), args, cadddr(proc));
+            exp = cons(BEGIN, caddr(proc)); /* procedure body */
             goto tail;
         }
     }
+    }
+    print_exp("Invalid arguments to eval:", exp);
+    printf("\n");
+    return NIL;
+}
+
+/*==============================================================================
+  Executing analyzed code
+  ==============================================================================*/
+
+struct object *execute(struct object *node, struct object *env);
+
+/* the value of an operand, with constants and variables taken in place */
+static inline struct object *operand(struct object *node, struct object *env) {
+    switch (node_op(node)) {
+    case OP_CONST:
+        return node->cdr;
+    case OP_LOCAL:
+        return lookup_local(node->cdr->cdr, env);
+    case OP_GLOBAL:
+        return global_value(node->cdr);
+    default:
+        return execute(node, env);
+    }
+}
+
+/* apply proc, other than a closure with code, to its evaluated arguments. exp
+   is the application, for messages */
+struct object *apply(struct object *proc, struct object *args,
+                     struct object *exp) {
+    struct object *env = NULL;
+    gc_frame();
+    gc_root(proc);
+    gc_root(args);
+    gc_root(exp);
+    gc_root(env);
+    profile_frame();
+    if (null(proc)) {
+#ifdef STRICT
+        print_exp("Invalid arguments to eval:", exp);
+        printf("\n");
+#endif
+        return NIL;
+    }
+    if (type_of(proc) == PRIMITIVE)
+        return proc->primitive(args);
+    if (is_tagged(proc, PROCEDURE)) {
+        /* a closure made by eval, or one whose code is out of date */
+        profile_enter(car(exp));
+        env = extend_env(cadr(proc), args, cadddr(proc));
+        return eval(cons(BEGIN, caddr(proc)), env);
+    }
     print_exp("Invalid arguments to eval:", exp);
     printf("\n");
     return NIL;
 }
 
+struct object *execute_list(struct object *nodes, struct object *env) {
+    if (null(nodes))
+        return NIL;
+    gc_frame();
+    gc_root(nodes);
+    gc_root(env);
+    struct object *tmp = operand(nodes->car, env);
+    gc_root(tmp);
+    return cons(tmp, execute_list(nodes->cdr, env));
+}
+
+/* the environment code runs in, extending env with a frame whose parameters
+   are the operands, evaluated in from. Names the body defines start out as
+   UNBOUND, surplus operands are evaluated and dropped */
+struct object *make_frame(struct object *code, struct object *operands,
+                          struct object *from, struct object *env) {
+    struct object *frame = NULL, *val = NULL;
+    int64_t slot = integer_value(code->vector[CODE_FIRST]);
+    int64_t size = integer_value(code->vector[CODE_SLOTS]);
+    int64_t i;
+    gc_frame();
+    gc_root(code);
+    gc_root(operands);
+    gc_root(from);
+    gc_root(env);
+    gc_root(frame);
+    gc_root(val);
+    frame = make_vector(size);
+    gc_write_barrier(frame, code->vector[CODE_NAMES]);
+    frame->vector[0] = code->vector[CODE_NAMES];
+    for (i = 1; i < slot; i++)
+        frame->vector[i] = UNBOUND;
+    for (; !null(operands); operands = operands->cdr, slot++) {
+        val = operand(operands->car, from);
+        if (slot < size) {
+            gc_write_barrier(frame, val);
+            frame->vector[slot] = val;
+        }
+    }
+    return cons(frame, env);
+}
+
+struct object *execute(struct object *node, struct object *env) {
+    struct object *proc = NULL, *code = NULL, *args = NULL;
+    gc_frame();
+    gc_root(node);
+    gc_root(env);
+    gc_root(proc);
+    gc_root(code);
+    gc_root(args);
+    profile_frame();
+tail:
+    switch (node_op(node)) {
+    case OP_CONST:
+        return node->cdr;
+    case OP_LOCAL:
+        return lookup_local(node->cdr->cdr, env);
+    case OP_GLOBAL:
+        return global_value(node->cdr);
+    case OP_NAME:
+        args = lookup_variable(node->cdr, env);
+        return null(args) ? unbound(node->cdr) : args;
+    case OP_SET_LOCAL:
+        set_local(node->cdr->car, execute(node->cdr->cdr, env), env);
+        return make_symbol("ok");
+    case OP_SET_NAME:
+        set_variable(node->cdr->car, execute(node->cdr->cdr, env), env);
+        return make_symbol("ok");
+    case OP_DEFINE:
+        define_variable(node->cdr->car, execute(node->cdr->cdr, env), env);
+        return make_symbol("ok");
+    case OP_DEFINE_LOCAL:
+        define_local(node->cdr->car, execute(node->cdr->cdr, env), env);
+        return make_symbol("ok");
+    case OP_IF:
+        args = node->cdr;
+        node = not_false(execute(args->car, env)) ? args->cdr->car
+                                                  : args->cdr->cdr;
+        goto tail;
+    case OP_SEQUENCE:
+        if (null(node->cdr))
+            return NIL;
+        for (args = node->cdr; !null(args->cdr); args = args->cdr)
+            execute(args->car, env);
+        node = args->car;
+        goto tail;
+    case OP_COND:
+        for (args = node->cdr; !null(args); args = args->cdr) {
+            if (not_false(execute(args->car->car, env))) {
+                node = args->car->cdr;
+                goto tail;
+            }
+        }
+        return NIL;
+    case OP_LAMBDA:
+        return make_closure(node->cdr, env);
+    case OP_LET:
+        code = node->cdr->car;
+        env = make_frame(code, node->cdr->cdr, env, env);
+        node = code->vector[CODE_NODE];
+        goto tail;
+    case OP_CALL:
+        /* (CALL exp operator . operands), exp being what it was analyzed
+           from */
+        args = node->cdr;
+        proc = operand(args->cdr->car, env);
+        if ((code = closure_code(proc)) != NULL) {
+            profile_enter(car(args->car));
+            env = make_frame(code, args->cdr->cdr, env, cadddr(proc));
+            node = code->vector[CODE_NODE];
+            goto tail;
+        }
+        args = execute_list(args->cdr->cdr, env);
+        return apply(proc, args, node->cdr->car);
+    }
+    return NIL;
+}
+
+/*==============================================================================
+  Bytecode compiler and virtual machine
+  ==============================================================================*/
+/* Started with --vm, analyzed code is compiled to bytecode and run on a stack
+   machine instead of by execute(). Bytecode is a vector of fixnum opcodes,
+   each followed by its operands; jumps hold the index they go to. A body is
+   compiled the first time it is called and kept in its code's CODE_BYTECODE,
+   so closures and frames are the same as execute()'s.
+
+   Operands, and the code, return index, environment and profiling site of
+   each call not in tail position, are kept on VM_STACK, which mark_roots()
+   scans up to vm_sp */
+
+enum vm_op {
+    VM_CONST,        // value
+    VM_LOCAL0,       // slot, of the current frame
+    VM_LOCAL,        // (depth . slot)
+    VM_GLOBAL,       // (name . cell)
+    VM_NAME,         // symbol
+    VM_SET_LOCAL,    // (depth . slot)
+    VM_SET_NAME,     // symbol
+    VM_DEFINE,       // symbol
+    VM_DEFINE_LOCAL, // slot, of the current frame
+    VM_POP,
+    VM_JUMP,         // index
+    VM_JUMP_FALSE,   // index
+    VM_CLOSURE,      // code
+    VM_ENTER,        // code count, a let's frame from count values
+    VM_LEAVE,
+    VM_CALL,         // count exp
+    VM_TAIL_CALL,    // count exp
+    VM_RETURN
+};
+
+bool use_vm = false; // set by --vm
+
+static inline void vm_push(struct object *obj) {
+    if (vm_sp == vm_size)
+        grow_vm_stack();
+    VM_STACK[vm_sp++] = obj;
+}
+
+#define vm_pop() (VM_STACK[--vm_sp])
+
+/* bytecode is put together in a buffer, everything in which is also held by
+   the nodes being compiled, until it is known how long it is */
+struct assembler {
+    struct object **words;
+    size_t top;
+    size_t size;
+};
+
+static size_t emit(struct assembler *as, struct object *word) {
+    if (as->top == as->size) {
+        as->size = as->size ? as->size << 1 : 64;
+        as->words = realloc(as->words, sizeof(struct object *) * as->size);
+        if (as->words == NULL)
+            error("Out of memory compiling");
+    }
+    as->words[as->top] = word;
+    return as->top++;
+}
+
+#define emit_op(as, op) (emit((as), make_fixnum(op)))
+#define patch(as, at) ((as)->words[(at)] = make_fixnum((as)->top))
+
+void compile(struct assembler *as, struct object *node, bool tail);
+
+void compile_clauses(struct assembler *as, struct object *clauses,
+                     bool tail) {
+    size_t next, end = 0;
+    if (null(clauses)) {
+        emit_op(as, VM_CONST);
+        emit(as, NIL);
+        if (tail)
+            emit_op(as, VM_RETURN);
+        return;
+    }
+    compile(as, clauses->car->car, false);
+    emit_op(as, VM_JUMP_FALSE);
+    next = emit(as, NIL);
+    compile(as, clauses->car->cdr, tail);
+    if (!tail) {
+        emit_op(as, VM_JUMP);
+        end = emit(as, NIL);
+    }
+    patch(as, next);
+    compile_clauses(as, clauses->cdr, tail);
+    if (!tail)
+        patch(as, end);
+}
+
+/* compile node to leave its value on the stack, or in tail position to return
+   it */
+void compile(struct assembler *as, struct object *node, bool tail) {
+    struct object *args = node->cdr;
+    size_t next, end = 0;
+    int64_t count = 0;
+    switch (node_op(node)) {
+    case OP_CONST:
+        emit_op(as, VM_CONST);
+        emit(as, args);
+        break;
+    case OP_LOCAL:
+        if (integer_value(args->cdr->car) == 0) {
+            emit_op(as, VM_LOCAL0);
+            emit(as, args->cdr->cdr);
+        } else {
+            emit_op(as, VM_LOCAL);
+            emit(as, args->cdr);
+        }
+        break;
+    case OP_GLOBAL:
+        emit_op(as, VM_GLOBAL);
+        emit(as, args);
+        break;
+    case OP_NAME:
+        emit_op(as, VM_NAME);
+        emit(as, args);
+        break;
+    case OP_SET_LOCAL:
+    case OP_SET_NAME:
+    case OP_DEFINE:
+    case OP_DEFINE_LOCAL:
+        compile(as, args->cdr, false);
+        emit_op(as, node_op(node) == OP_SET_LOCAL  ? VM_SET_LOCAL
+                    : node_op(node) == OP_SET_NAME ? VM_SET_NAME
+                    : node_op(node) == OP_DEFINE   ? VM_DEFINE
+                                                   : VM_DEFINE_LOCAL);
+        emit(as, args->car);
+        break;
+    case OP_IF:
+        compile(as, args->car, false);
+        emit_op(as, VM_JUMP_FALSE);
+        next = emit(as, NIL);
+        compile(as, args->cdr->car, tail);
+        if (!tail) {
+            emit_op(as, VM_JUMP);
+            end = emit(as, NIL);
+        }
+        patch(as, next);
+        compile(as, args->cdr->cdr, tail);
+        if (!tail)
+            patch(as, end);
+        return;
+    case OP_SEQUENCE:
+        if (null(args)) {
+            emit_op(as, VM_CONST);
+            emit(as, NIL);
+            break;
+        }
+        for (; !null(args->cdr); args = args->cdr) {
+            compile(as, args->car, false);
+            emit_op(as, VM_POP);
+        }
+        compile(as, args->car, tail);
+        return;
+    case OP_COND:
+        compile_clauses(as, args, tail);
+        return;
+    case OP_LAMBDA:
+        emit_op(as, VM_CLOSURE);
+        emit(as, args);
+        break;
+    case OP_LET:
+        for (node = args->cdr; !null(node); node = node->cdr, count++)
+            compile(as, node->car, false);
+        emit_op(as, VM_ENTER);
+        emit(as, args->car);
+        emit(as, make_fixnum(count));
+        compile(as, args->car->vector[CODE_NODE], tail);
+        if (!tail)
+            emit_op(as, VM_LEAVE);
+        return;
+    case OP_CALL:
+        for (node = args->cdr; !null(node); node = node->cdr, count++)
+            compile(as, node->car, false);
+        emit_op(as, tail ? VM_TAIL_CALL : VM_CALL);
+        emit(as, make_fixnum(count - 1)); // less the operator
+        emit(as, args->car);
+        return;
+    }
+    if (tail)
+        emit_op(as, VM_RETURN);
+}
+
+/* the bytecode returning the value of node */
+struct object *assemble(struct object *node) {
+    struct assembler as = {NULL, 0, 0};
+    struct object *code = NULL;
+    size_t i;
+    gc_frame();
+    gc_root(node);
+    gc_root(code);
+    compile(&as, node, true);
+    code = make_vector(as.top);
+    for (i = 0; i < as.top; i++) {
+        gc_write_barrier(code, as.words[i]);
+        code->vector[i] = as.words[i];
+    }
+    free(as.words);
+    return code;
+}
+
+/* a frame for code whose first count values are the top count on the stack,
+   which are left there */
+static struct object *vm_frame(struct object *code, int64_t count) {
+    struct object **vals;
+    int64_t slot = integer_value(code->vector[CODE_FIRST]);
+    int64_t size = integer_value(code->vector[CODE_SLOTS]);
+    int64_t i;
+    struct object *frame = make_vector(size);
+    vals = &VM_STACK[vm_sp - count];
+    gc_write_barrier(frame, code->vector[CODE_NAMES]);
+    frame->vector[0] = code->vector[CODE_NAMES];
+    for (i = 1; i < slot; i++)
+        frame->vector[i] = UNBOUND;
+    for (i = 0; i < count && slot + i < size; i++) {
+        gc_write_barrier(frame, vals[i]);
+        frame->vector[slot + i] = vals[i];
+    }
+    return frame;
+}
+
+#define DISPATCH() goto *dispatch[(uintptr_t)*pc++ >> 1]
+
+/* run bytecode in env, with the stack as it is left as it is found */
+struct object *vm_run(struct object *code, struct object *env) {
+    static void *dispatch[] = {
+        [VM_CONST] = &&op_const,
+        [VM_LOCAL0] = &&op_local0,
+        [VM_LOCAL] = &&op_local,
+        [VM_GLOBAL] = &&op_global,
+        [VM_NAME] = &&op_name,
+        [VM_SET_LOCAL] = &&op_set_local,
+        [VM_SET_NAME] = &&op_set_name,
+        [VM_DEFINE] = &&op_define,
+        [VM_DEFINE_LOCAL] = &&op_define_local,
+        [VM_POP] = &&op_pop,
+        [VM_JUMP] = &&op_jump,
+        [VM_JUMP_FALSE] = &&op_jump_false,
+        [VM_CLOSURE] = &&op_closure,
+        [VM_ENTER] = &&op_enter,
+        [VM_LEAVE] = &&op_leave,
+        [VM_CALL] = &&op_call,
+        [VM_TAIL_CALL] = &&op_call,
+        [VM_RETURN] = &&op_return,
+    };
+    struct object *proc = NULL, *callee = NULL, *val = NULL, *exp;
+    struct object **pc = code->vector;
+    size_t base = vm_sp;
+    int64_t count;
+    bool tail;
+    gc_frame();
+    gc_root(code);
+    gc_root(env);
+    gc_root(proc);
+    gc_root(callee);
+    gc_root(val);
+    profile_frame();
+    DISPATCH();
+
+op_const:
+    vm_push(*pc++);
+    DISPATCH();
+op_local0:
+    val = env->car;
+    count = (uintptr_t)*pc++ >> 1;
+    if (type_of(val) != VECTOR || count >= val->vsize)
+        val = NIL; // as lookup_local has it
+    else if ((val = val->vector[count]) == UNBOUND)
+        val = lookup_outer(env, count);
+    vm_push(val);
+    DISPATCH();
+op_local:
+    vm_push(lookup_local(*pc++, env));
+    DISPATCH();
+op_global:
+    vm_push(global_value(*pc++));
+    DISPATCH();
+op_name:
+    val = lookup_variable(*pc, env);
+    if (null(val))
+        val = unbound(*pc);
+    pc++;
+    vm_push(val);
+    DISPATCH();
+op_set_local:
+    set_local(*pc++, VM_STACK[vm_sp - 1], env);
+    goto op_ok;
+op_set_name:
+    set_variable(*pc++, VM_STACK[vm_sp - 1], env);
+    goto op_ok;
+op_define:
+    define_variable(*pc++, VM_STACK[vm_sp - 1], env);
+    goto op_ok;
+op_define_local:
+    define_local(*pc++, VM_STACK[vm_sp - 1], env);
+op_ok:
+    val = make_symbol("ok");
+    VM_STACK[vm_sp - 1] = val;
+    DISPATCH();
+op_pop:
+    vm_sp--;
+    DISPATCH();
+op_jump:
+    pc = code->vector + ((uintptr_t)*pc >> 1);
+    DISPATCH();
+op_jump_false:
+    if (not_false(vm_pop()))
+        pc++;
+    else
+        pc = code->vector + ((uintptr_t)*pc >> 1);
+    DISPATCH();
+op_closure:
+    val = make_closure(*pc++, env);
+    vm_push(val);
+    DISPATCH();
+op_enter:
+    count = (uintptr_t)pc[1] >> 1;
+    val = vm_frame(pc[0], count);
+    pc += 2;
+    vm_sp -= count;
+    env = cons(val, env);
+    DISPATCH();
+op_leave:
+    env = env->cdr;
+    DISPATCH();
+
+op_call:
+    tail = ((uintptr_t)pc[-1] >> 1) == VM_TAIL_CALL;
+    count = (uintptr_t)pc[0] >> 1;
+    exp = pc[1];
+    pc += 2;
+    proc = VM_STACK[vm_sp - count - 1];
+    if ((callee = closure_code(proc)) != NULL) {
+        if (null(callee->vector[CODE_BYTECODE])) {
+            val = assemble(callee->vector[CODE_NODE]);
+            gc_write_barrier(callee, val);
+            callee->vector[CODE_BYTECODE] = val;
+        }
+        val = vm_frame(callee, count);
+        vm_sp -= count + 1;
+        if (!tail) {
+            vm_push(code);
+            vm_push(make_fixnum(pc - code->vector));
+            vm_push(env);
+            vm_push(profile_save());
+        }
+        profile_enter(car(exp));
+        env = cons(val, cadddr(proc));
+        code = callee->vector[CODE_BYTECODE];
+        pc = code->vector;
+        DISPATCH();
+    }
+    for (val = NIL; count > 0; count--)
+        val = cons(VM_STACK[vm_sp - 1], val), vm_sp--;
+    vm_sp--; // the operator, held in proc
+    val = apply(proc, val, exp);
+    vm_push(val);
+    if (!tail)
+        DISPATCH();
+op_return:
+    val = vm_pop();
+    if (vm_sp == base)
+        return val;
+    profile_restore(vm_pop());
+    env = vm_pop();
+    count = (uintptr_t)vm_pop() >> 1;
+    code = vm_pop();
+    pc = code->vector + count;
+    vm_push(val);
+    DISPATCH();
+}
+
+/* analyze a top level form and run it in the global environment */
+struct object *run_toplevel(struct object *exp) {
+    gc_frame();
+    gc_root(exp);
+    exp = analyze(exp, NIL);
+    if (!use_vm)
+        return execute(exp, ENV);
+    exp = assemble(exp);
+    return vm_run(exp, ENV);
+}
+
 extern char **environ;
-struct object *prim_exec(void *workspace, struct object *args) {
+struct object *prim_exec(struct object *args) {
     ASSERT_TYPE(car(args), STRING);
     int l = length(args);
     struct object *tmp = args;
-    create_workspace(2);
-    set_local(0, tmp);
-    set_local(1, args);
+    gc_frame();
+    gc_root(tmp);
+    gc_root(args);
 
     char **newarg = malloc(sizeof(char *) * (l + 1));
     char **n = newarg;
@@ -1137,21 +3864,101 @@ struct object *prim_exec(void *workspace, struct object *args) {
     return NIL;
 }
 
+/* Every primitive, in the order they are bound. Heap images refer to them by
+   their index in here, which stays the same from one run to the next where the
+   function addresses may not */
+static const struct primitive {
+    char *name;
+    primitive_t function;
+} PRIMITIVES[] = {
+    {"cons", prim_cons},
+    {"car", prim_car},
+    {"cdr", prim_cdr},
+    {"set-car!", prim_setcar},
+    {"set-cdr!", prim_setcdr},
+    {"list", prim_list},
+    {"list?", prim_listq},
+    {"null?", prim_nullq},
+    {"pair?", prim_pairq},
+    {"atom?", prim_atomq},
+    {"eq?", prim_eq},
+    {"equal?", prim_equal},
+
+    {"+", prim_add},
+    {"-", prim_sub},
+    {"*", prim_mul},
+    {"/", prim_div},
+    {"=", prim_neq},
+    {"<", prim_lt},
+    {">", prim_gt},
+
+    {"type", prim_type},
+    {"load", load_file},
+    {"print", prim_print},
+    {"get-global-environment", prim_get_env},
+    {"set-global-environment", prim_set_env},
+    {"exit", prim_exit},
+    {"exec", prim_exec},
+    {"read", prim_read},
+    {"vector", prim_vec},
+    {"vector-get", prim_vget},
+    {"vector-set", prim_vset},
+    {"make-hash-table", prim_make_table},
+    {"hash-table-ref", prim_table_ref},
+    {"hash-table-set!", prim_table_set},
+    {"hash-table-delete!", prim_table_delete},
+    {"hash-table-count", prim_table_count},
+    {"hash-table->alist", prim_table_alist},
+    {"hash-table-keys", prim_table_keys},
+    {"hash-table-values", prim_table_values},
+    {"gc-objects-used", prim_gc_objects_used},
+    {"gc-pool-size", prim_gc_pool_size},
+    {"gc-total-allocated", prim_gc_total_alloc},
+    {"gc-pass", prim_gc_pass},
+    {"gc-max-pause-us", prim_gc_max_pause},
+    {"gc-set-pause-budget-us", prim_gc_pause_budget},
+    {"gc-stats", prim_gc_stats},
+    {"gc-set-mark-threads", prim_gc_mark_threads},
+    {"gc-set-background-sweep", prim_gc_background_sweep},
+    {"gc-set-nursery-bytes", prim_gc_nursery_bytes},
+    {"gc-set-target-live-percent", prim_gc_target_live},
+    {"gc-set-shrink-slack-percent", prim_gc_shrink_slack},
+};
+#define PRIMITIVE_COUNT (sizeof(PRIMITIVES) / sizeof(PRIMITIVES[0]))
+
+/* intern the special forms not bound to themselves, and tag the symbols of
+   all of them */
+void intern_special_forms(void) {
+    OR = make_symbol("or");
+    COND = make_symbol("cond");
+    ELSE = make_symbol("else");
+    QUOTE->form = FORM_QUOTE;
+    LAMBDA->form = FORM_LAMBDA;
+    DEFINE->form = FORM_DEFINE;
+    SET->form = FORM_SET;
+    LET->form = FORM_LET;
+    BEGIN->form = FORM_BEGIN;
+    IF->form = FORM_IF;
+    OR->form = FORM_OR;
+    COND->form = FORM_COND;
+}
+
 /* Initialize the global environment, add primitive functions and symbols */
-void init_env(void *workspace) {
-#define add_prim(s, c)                                                         \
-    tmp_sym = make_symbol(workspace, s);                                       \
-    define_variable(workspace, tmp_sym, make_primitive(workspace, c), ENV)
+void init_env(void) {
 #define add_sym(s, c)                                                          \
     do {                                                                       \
-        c = make_symbol(workspace, s);                                         \
-        set_local(1, c);                                                       \
-        define_variable(workspace, c, c, ENV);                                 \
+        c = make_symbol(s);                                                    \
+        gc_root(c);                                                            \
+        define_variable(c, c, ENV);                                            \
     } while (0);
     struct object *tmp_sym = NULL;
-    create_workspace(2);
-    set_local(0, tmp_sym);
-    ENV = extend_env(workspace, NIL, NIL, NIL);
+    size_t i;
+    gc_frame();
+    gc_root(tmp_sym);
+    ENV = extend_env(NIL, NIL, NIL);
+    GLOBAL_FRAME = car(ENV);
+    GLOBALS = make_hash_table(false);
+    UNBOUND = make_symbol("#<unbound variable>");
     add_sym("#t", TRUE);
     add_sym("#f", FALSE);
     add_sym("quote", QUOTE);
@@ -1162,53 +3969,22 @@ void init_env(void *workspace) {
     add_sym("set!", SET);
     add_sym("begin", BEGIN);
     add_sym("if", IF);
-    define_variable(workspace, make_symbol(workspace, "true"), TRUE, ENV);
-    define_variable(workspace, make_symbol(workspace, "false"), FALSE, ENV);
-
-    add_prim("cons", prim_cons);
-    add_prim("car", prim_car);
-    add_prim("cdr", prim_cdr);
-    add_prim("set-car!", prim_setcar);
-    add_prim("set-cdr!", prim_setcdr);
-    add_prim("list", prim_list);
-    add_prim("list?", prim_listq);
-    add_prim("null?", prim_nullq);
-    add_prim("pair?", prim_pairq);
-    add_prim("atom?", prim_atomq);
-    add_prim("eq?", prim_eq);
-    add_prim("equal?", prim_equal);
-
-    add_prim("+", prim_add);
-    add_prim("-", prim_sub);
-    add_prim("*", prim_mul);
-    add_prim("/", prim_div);
-    add_prim("=", prim_neq);
-    add_prim("<", prim_lt);
-    add_prim(">", prim_gt);
-
-    add_prim("type", prim_type);
-    add_prim("load", load_file);
-    add_prim("print", prim_print);
-    add_prim("get-global-environment", prim_get_env);
-    add_prim("set-global-environment", prim_set_env);
-    add_prim("exit", prim_exit);
-    add_prim("exec", prim_exec);
-    add_prim("read", prim_read);
-    add_prim("vector", prim_vec);
-    add_prim("vector-get", prim_vget);
-    add_prim("vector-set", prim_vset);
-    add_prim("gc-objects-used", prim_gc_objects_used);
-    add_prim("gc-pool-size", prim_gc_pool_size);
-    add_prim("gc-total-allocated", prim_gc_total_alloc);
-    add_prim("gc-pass", prim_gc_pass);
+    intern_special_forms();
+    define_variable(make_symbol("true"), TRUE, ENV);
+    define_variable(make_symbol("false"), FALSE, ENV);
+
+    for (i = 0; i < PRIMITIVE_COUNT; i++) {
+        tmp_sym = make_symbol(PRIMITIVES[i].name);
+        define_variable(tmp_sym, make_primitive(PRIMITIVES[i].function), ENV);
+    }
 }
 
 /* Loads and evaluates a file containing lisp s-expressions */
-struct object *load_file(void *workspace, struct object *args) {
+struct object *load_file(struct object *args) {
     struct object *exp = NULL;
     struct object *ret = NULL;
-    create_workspace(1);
-    set_local(0, exp);
+    gc_frame();
+    gc_root(exp);
     char *filename = car(args)->string;
     printf("Evaluating file %s\n", filename);
     FILE *fp = fopen(filename, "r");
@@ -1218,32 +3994,458 @@ struct object *load_file(void *workspace, struct object *args) {
     }
 
     for (;;) {
-        exp = read_exp(workspace, fp);
+        exp = read_exp(fp);
         if (null(exp))
             break;
-        ret = eval(workspace, exp, ENV);
+        ret = run_toplevel(exp);
     }
     fclose(fp);
     return ret;
 }
 
+/*==============================================================================
+  Heap images
+  ==============================================================================*/
+/* An image holds everything reachable from the global environment, written
+   out once the startup files have been loaded so that later runs can map it
+   in rather than read and evaluate them all over again. Objects are numbered
+   in the order they are found and refer to each other by number: a reference
+   is 0 for NULL, a fixnum as it is (its low bit is set), or otherwise the
+   number of the object plus one, shifted left. Primitives are saved as their
+   index in PRIMITIVES, and the symbol table is rebuilt from the symbols in the
+   image. Nothing else about the layout is portable, images are only meant for
+   the binary that wrote them.
+
+   The file is the header, a record for every object, the references held by
+   vectors and hash tables, and the text of every symbol and string, each NUL
+   terminated */
+#define IMAGE_MAGIC "uscheme\1"
+
+struct image_header {
+    char magic[8];
+    uint32_t primitives; // PRIMITIVE_COUNT of the binary that wrote it
+    uint32_t objects;
+    uint64_t refs;  // vector items, and hash table keys and values
+    uint64_t chars; // bytes of text
+    uint64_t env;
+};
+
+struct image_object {
+    uint32_t type;
+    uint32_t size; // length of the text, vector size or hash table count
+    uint64_t a;    // car, integer, primitive index, or where the text or the
+                   // references start
+    uint64_t b;    // cdr, or whether a hash table is keyed by equal?
+};
+
+struct image_buffer {
+    char *data;
+    size_t used;
+    size_t size;
+};
+
+/* room for bytes more at the end of the buffer */
+static void *image_grab(struct image_buffer *buf, size_t bytes) {
+    if (buf->used + bytes > buf->size) {
+        while (buf->used + bytes > buf->size)
+            buf->size = buf->size ? buf->size << 1 : 4096;
+        buf->data = realloc(buf->data, buf->size);
+        if (buf->data == NULL)
+            error("Out of memory writing heap image");
+    }
+    buf->used += bytes;
+    return buf->data + buf->used - bytes;
+}
+
+/* The objects numbered so far, and an open addressed map from their
+   addresses to their numbers */
+struct image_writer {
+    struct object **objects;
+    size_t count;
+    size_t size;
+    struct image_slot {
+        struct object *obj;
+        size_t number;
+    } * map;
+    size_t map_size; // a power of two
+    struct image_buffer records, refs, chars;
+};
+
+static void image_map_put(struct image_writer *w, struct object *obj,
+                          size_t number) {
+    size_t pos = mix_hash((uintptr_t)obj) & (w->map_size - 1);
+    while (w->map[pos].obj != NULL)
+        pos = (pos + 1) & (w->map_size - 1);
+    w->map[pos].obj = obj;
+    w->map[pos].number = number;
+}
+
+/* the reference to an object, numbering it if it has not been seen yet */
+uint64_t image_ref(struct image_writer *w, struct object *obj) {
+    size_t i, pos;
+    if (obj == NULL || is_fixnum(obj))
+        return (uintptr_t)obj;
+    pos = mix_hash((uintptr_t)obj) & (w->map_size - 1);
+    for (; w->map[pos].obj != NULL; pos = (pos + 1) & (w->map_size - 1))
+        if (w->map[pos].obj == obj)
+            return (w->map[pos].number + 1) << 1;
+    if (w->count == UINT32_MAX)
+        error("Too many objects for a heap image");
+    if (w->count == w->size) {
+        w->size <<= 1;
+        w->objects = realloc(w->objects, sizeof(struct object *) * w->size);
+        if (w->objects == NULL)
+            error("Out of memory writing heap image");
+    }
+    w->objects[w->count] = obj;
+    image_map_put(w, obj, w->count);
+    if (w->count + 1 > HT_MAX_LOAD(w->map_size)) {
+        struct image_slot *old = w->map;
+        size_t old_size = w->map_size;
+        w->map_size <<= 1;
+        w->map = calloc(w->map_size, sizeof(struct image_slot));
+        if (w->map == NULL)
+            error("Out of memory writing heap image");
+        for (i = 0; i < old_size; i++)
+            if (old[i].obj != NULL)
+                image_map_put(w, old[i].obj, old[i].number);
+        free(old);
+    }
+    return (++w->count) << 1;
+}
+
+/* Write everything reachable from ENV to filename. Records are added as the
+   objects are numbered, each one numbering whatever it refers to in turn, so
+   once the last record is written every object has one */
+void dump_image(char *filename) {
+    struct image_writer w = {0};
+    struct image_header header = {.magic = IMAGE_MAGIC,
+                                  .primitives = PRIMITIVE_COUNT};
+    size_t i, j;
+    w.size = w.map_size = 1024;
+    w.objects = malloc(sizeof(struct object *) * w.size);
+    w.map = calloc(w.map_size, sizeof(struct image_slot));
+    if (w.objects == NULL || w.map == NULL)
+        error("Out of memory writing heap image");
+    header.env = image_ref(&w, ENV);
+    for (i = 0; i < w.count; i++) {
+        struct object *obj = w.objects[i];
+        struct image_object *rec = image_grab(&w.records, sizeof(*rec));
+        memset(rec, 0, sizeof(*rec));
+        rec->type = type_of(obj);
+        switch (rec->type) {
+        case INTEGER:
+            rec->a = obj->integer;
+            break;
+        case SYMBOL:
+        case STRING: {
+            size_t length =
+                rec->type == SYMBOL ? strlen(obj->string) : obj->length;
+            if (length > UINT32_MAX)
+                error("String too long for a heap image");
+            rec->size = length;
+            rec->a = w.chars.used;
+            memcpy(image_grab(&w.chars, length + 1), obj->string, length + 1);
+            break;
+        }
+        case LIST:
+            rec->a = image_ref(&w, obj->car);
+            rec->b = image_ref(&w, obj->cdr);
+            break;
+        case PRIMITIVE:
+            while (rec->a < PRIMITIVE_COUNT &&
+                   PRIMITIVES[rec->a].function != obj->primitive)
+                rec->a++;
+            break;
+        case VECTOR:
+            rec->size = obj->vsize;
+            rec->a = w.refs.used / sizeof(uint64_t);
+            for (j = 0; j < (size_t)obj->vsize; j++) {
+                uint64_t ref = image_ref(&w, obj->vector[j]);
+                memcpy(image_grab(&w.refs, sizeof(ref)), &ref, sizeof(ref));
+            }
+            break;
+        case HASHTABLE:
+            rec->size = obj->count;
+            rec->a = w.refs.used / sizeof(uint64_t);
+            rec->b = obj->equal;
+            for (j = 0; j < obj->capacity; j++) {
+                if (obj->entries[j].hash == 0)
+                    continue;
+                uint64_t refs[2] = {image_ref(&w, obj->entries[j].key),
+                                    image_ref(&w, obj->entries[j].value)};
+                memcpy(image_grab(&w.refs, sizeof(refs)), refs, sizeof(refs));
+            }
+            break;
+        }
+    }
+    header.objects = w.count;
+    header.refs = w.refs.used / sizeof(uint64_t);
+    header.chars = w.chars.used;
+
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL ||
+        fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(w.records.data, 1, w.records.used, fp) != w.records.used ||
+        fwrite(w.refs.data, 1, w.refs.used, fp) != w.refs.used ||
+        fwrite(w.chars.data, 1, w.chars.used, fp) != w.chars.used ||
+        fclose(fp) != 0)
+        error("Could not write heap image");
+    free(w.objects);
+    free(w.map);
+    free(w.records.data);
+    free(w.refs.data);
+    free(w.chars.data);
+}
+
+/* the object a reference stands for, once every object has been allocated */
+static inline struct object *image_object(struct object *all, uint64_t ref) {
+    if (ref == 0 || (ref & 1))
+        return (struct object *)(uintptr_t)ref;
+    if ((ref >> 1) > (uint64_t)all->vsize)
+        error("Corrupt heap image");
+    return all->vector[(ref >> 1) - 1];
+}
+
+/* Map an image and rebuild its objects in the heap, in place of init_env.
+   Every object is allocated first, kept alive by a vector of the lot, and
+   the references are filled in after. Hash tables are filled last of all,
+   since keys in equal? tables hash by their contents. Nothing in an image is
+   garbage, so the nursery is opened up while it is read in */
+void load_image(char *filename) {
+    struct object *all = NULL, *obj = NULL;
+    struct stat st;
+    size_t i, j;
+    gc_frame();
+    gc_root(all);
+    gc_root(obj);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 ||
+        (size_t)st.st_size < sizeof(struct image_header))
+        error("Could not open heap image");
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        error("Could not map heap image");
+    struct image_header *header = (struct image_header *)base;
+    struct image_object *records = (struct image_object *)(header + 1);
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) ||
+        header->primitives != PRIMITIVE_COUNT)
+        error("Heap image was written by a different build");
+    /* each count is checked against what is left of the file before it is
+       multiplied out, so that a count too large to be real cannot wrap */
+    uint64_t left = st.st_size - sizeof(*header);
+    if (header->objects > INT_MAX || header->objects > left / sizeof(*records))
+        error("Corrupt heap image");
+    left -= sizeof(*records) * header->objects;
+    if (header->refs > left / sizeof(uint64_t))
+        error("Corrupt heap image");
+    left -= sizeof(uint64_t) * header->refs;
+    if (header->chars != left)
+        error("Corrupt heap image");
+    uint64_t *refs = (uint64_t *)(records + header->objects);
+    char *chars = (char *)(refs + header->refs);
+
+    size_t nursery = gc_nursery_bytes;
+    gc_nursery_bytes = SIZE_MAX;
+    all = make_vector(header->objects);
+    for (i = 0; i < header->objects; i++) {
+        struct image_object *rec = &records[i];
+        if ((rec->type == SYMBOL || rec->type == STRING) &&
+            (rec->a >= header->chars || rec->size >= header->chars - rec->a ||
+             chars[rec->a + rec->size]))
+            error("Corrupt heap image");
+        if ((rec->type == VECTOR || rec->type == HASHTABLE) &&
+            (rec->a > header->refs ||
+             (rec->type == VECTOR ? 1 : 2) * (uint64_t)rec->size >
+                 header->refs - rec->a))
+            error("Corrupt heap image");
+        switch (rec->type) {
+        case INTEGER:
+            obj = make_integer(rec->a);
+            break;
+        case SYMBOL:
+            obj = make_symbol(chars + rec->a);
+            break;
+        case STRING: {
+            char *s = malloc(rec->size + 1);
+            if (s == NULL)
+                error("Out of memory loading heap image");
+            memcpy(s, chars + rec->a, rec->size + 1);
+            obj = make_string(s, rec->size);
+            break;
+        }
+        case LIST:
+            obj = cons(NULL, NULL);
+            break;
+        case PRIMITIVE:
+            if (rec->a >= PRIMITIVE_COUNT)
+                error("Corrupt heap image");
+            obj = make_primitive(PRIMITIVES[rec->a].function);
+            break;
+        case VECTOR:
+            obj = make_vector(rec->size);
+            break;
+        case HASHTABLE:
+            obj = make_hash_table(rec->b);
+            break;
+        default:
+            error("Corrupt heap image");
+        }
+        gc_write_barrier(all, obj);
+        all->vector[i] = obj;
+    }
+    for (i = 0; i < header->objects; i++) {
+        struct image_object *rec = &records[i];
+        obj = all->vector[i];
+        if (rec->type == LIST) {
+            obj->car = image_object(all, rec->a);
+            obj->cdr = image_object(all, rec->b);
+            gc_write_barrier(obj, obj->car);
+            gc_write_barrier(obj, obj->cdr);
+        } else if (rec->type == VECTOR) {
+            for (j = 0; j < rec->size; j++) {
+                obj->vector[j] = image_object(all, refs[rec->a + j]);
+                gc_write_barrier(obj, obj->vector[j]);
+            }
+        }
+    }
+    for (i = 0; i < header->objects; i++) {
+        struct image_object *rec = &records[i];
+        if (rec->type != HASHTABLE)
+            continue;
+        obj = all->vector[i];
+        for (j = 0; j < rec->size; j++) {
+            struct object *key = image_object(all, refs[rec->a + 2 * j]);
+            struct object *value = image_object(all, refs[rec->a + 2 * j + 1]);
+            gc_write_barrier(obj, key);
+            gc_write_barrier(obj, value);
+            table_set(obj, key, value);
+        }
+    }
+    ENV = image_object(all, header->env);
+    /* the global frame is the outermost one, its index is built up again */
+    for (obj = ENV; !null(cdr(obj)); obj = cdr(obj))
+        ;
+    GLOBAL_FRAME = car(obj);
+    GLOBALS = make_hash_table(false);
+    struct object *vars = car(GLOBAL_FRAME), *vals = cdr(GLOBAL_FRAME);
+    for (; is_pair(vars); vars = cdr(vars), vals = cdr(vals)) {
+        if (table_find(GLOBALS, car(vars), key_hash(car(vars), false)) >= 0)
+            continue; // shadowed by a later definition
+        gc_write_barrier(GLOBALS, car(vars));
+        gc_write_barrier(GLOBALS, vals);
+        table_set(GLOBALS, car(vars), vals);
+    }
+    gc_nursery_bytes = nursery;
+    munmap(base, st.st_size);
+
+    TRUE = make_symbol("#t");
+    FALSE = make_symbol("#f");
+    QUOTE = make_symbol("quote");
+    LAMBDA = make_symbol("lambda");
+    PROCEDURE = make_symbol("procedure");
+    DEFINE = make_symbol("define");
+    LET = make_symbol("let");
+    SET = make_symbol("set!");
+    BEGIN = make_symbol("begin");
+    IF = make_symbol("if");
+    intern_special_forms();
+    /* the cells of globals referred to but not defined yet go back in
+       GLOBALS, found by the names they keep, which frames' slots holding
+       UNBOUND do not */
+    UNBOUND = make_symbol("#<unbound variable>");
+    for (i = 0; i < (size_t)all->vsize; i++) {
+        obj = all->vector[i];
+        if (!is_pair(obj) || obj->car != UNBOUND || null(obj->cdr) ||
+            type_of(obj->cdr) != SYMBOL ||
+            table_find(GLOBALS, obj->cdr, key_hash(obj->cdr, false)) >= 0)
+            continue;
+        gc_write_barrier(GLOBALS, obj->cdr);
+        gc_write_barrier(GLOBALS, obj);
+        table_set(GLOBALS, obj->cdr, obj);
+    }
+}
+
+/* override a collector knob from the environment, ignoring values below min
+   or above max */
+void gc_knob_from_env(const char *name, size_t *knob, size_t min, size_t max) {
+    char *value = getenv(name);
+    size_t n;
+    if (value == NULL)
+        return;
+    n = strtoull(value, NULL, 10);
+    if (n >= min && n <= max)
+        *knob = n;
+}
+
 int main(int argc, char **argv) {
-    GC_HEAD = NULL;
-    void *workspace = workspace_base;
-    int NELEM = 8191;
-    ht_init(NELEM);
-    init_env(workspace);
+    char *budget = getenv("MICROLISP_GC_PAUSE_US");
+    if (budget)
+        gc_pause_budget_us = strtoull(budget, NULL, 10);
+    gc_knob_from_env("MICROLISP_GC_NURSERY_BYTES", &gc_nursery_bytes, 1,
+                     SIZE_MAX);
+    gc_knob_from_env("MICROLISP_GC_TARGET_LIVE_PCT", &gc_target_live_pct, 1,
+                     100);
+    gc_knob_from_env("MICROLISP_GC_SHRINK_SLACK_PCT", &gc_shrink_slack_pct, 0,
+                     SIZE_MAX);
+    gc_knob_from_env("MICROLISP_GC_MARK_THREADS", &gc_mark_threads, 1,
+                     GC_MAX_MARK_THREADS);
+    /* a sweeper thread only pays off with a core to run it on */
+    gc_background_sweep = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    gc_knob_from_env("MICROLISP_GC_BACKGROUND_SWEEP", &gc_background_sweep, 0,
+                     1);
+    /* MICROLISP_GC_STATS=N dumps the collector statistics to stderr on exit,
+       and every N collections as well unless N is 0 */
+    char *stats = getenv("MICROLISP_GC_STATS");
+    if (stats) {
+        gc_stats_every = strtoull(stats, NULL, 10);
+        atexit(gc_dump_stats_at_exit);
+    }
+#ifdef ALLOC_PROFILE
+    atexit(profile_report);
+#endif
+    /* --image file starts from a heap image instead of a fresh environment,
+       --dump-image file writes one out once the other files are loaded, and
+       --vm runs everything on the bytecode VM */
+    char *image = NULL, *dump = NULL;
     struct object *exp = NULL;
     int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--vm"))
+            use_vm = true;
+        if (strcmp(argv[i], "--image") && strcmp(argv[i], "--dump-image"))
+            continue;
+        if (i + 1 == argc)
+            error("usage: microlisp [--vm] [--image file] [--dump-image file] "
+                  "[file ...]");
+        if (!strcmp(argv[i], "--image"))
+            image = argv[i + 1];
+        else
+            dump = argv[i + 1];
+        i++;
+    }
+    ht_init(1024);
+    if (image)
+        load_image(image);
+    else
+        init_env();
 
     printf("uscheme intrepreter - michael lazear (c) 2016-2017\n");
-    for (i = 1; i < argc; i++)
-        load_file(workspace,
-                  cons(workspace, make_symbol(workspace, argv[i]), NIL));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--image") || !strcmp(argv[i], "--dump-image"))
+            i++;
+        else if (strcmp(argv[i], "--vm"))
+            load_file(cons(make_symbol(argv[i]), NIL));
+    }
+    if (dump) {
+        dump_image(dump);
+        exit(0);
+    }
 
     for (;;) {
         printf("user> ");
-        exp = eval(workspace, read_exp(workspace, stdin), ENV);
+        exp = run_toplevel(read_exp(stdin));
         if (!null(exp)) {
             print_exp("====>", exp);
             printf("\n");
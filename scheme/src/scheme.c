@@ -44,7 +44,13 @@ struct object {
     type_t type;
     union {
         int64_t integer;
-        char *string;
+        struct {
+            char *string;
+            union {
+                uint32_t hash; // SYMBOL: computed once when interned
+                size_t length; // STRING: bytes, excluding the terminator
+            };
+        };
         struct {
             struct object **vector;
             int vsize;
@@ -85,40 +91,102 @@ struct object *lookup_variable(struct object *var, struct object *env);
 /*==============================================================================
 Hash table for saving Lisp symbol objects. Conserves memory and faster compares
 ==============================================================================*/
+/* Open addressing (Robin Hood) table. Each slot caches the full hash of its
+   key, so probes only fall back to strcmp when the hashes match. Entries that
+   are further from their home slot steal the position of entries that are
+   closer to theirs, which keeps probe sequences short even at high load */
 struct htable {
     struct object *key;
+    uint32_t hash;
 };
-/* One dimensional hash table */
 static struct htable *HTABLE = NULL;
-static int HTABLE_SIZE;
+static size_t HTABLE_SIZE; // always a power of two
+static size_t HTABLE_COUNT;
+
+#define HT_MAX_LOAD(size) (((size) >> 2) * 3) // resize past 75% full
+#define HT_DIST(h, pos) (((pos) - ((h) & (HTABLE_SIZE - 1))) & (HTABLE_SIZE - 1))
 
-static uint64_t hash(const char *s) {
-    uint64_t h = 0;
+/* FNV-1a */
+static uint32_t hash(const char *s) {
+    uint32_t h = 2166136261u;
     uint8_t *u = (uint8_t *)s;
     while (*u) {
-        h = (h * 256 + *u) % HTABLE_SIZE;
-        u++;
+        h ^= *u++;
+        h *= 16777619u;
     }
     return h;
 }
 
-int ht_init(int size) {
-    if (HTABLE || !(size % 2))
-        error("Hash table already initialized or even # of entries");
-    HTABLE = malloc(sizeof(struct htable) * size);
-    memset(HTABLE, 0, sizeof(struct htable) * size);
+size_t ht_init(size_t size) {
+    if (HTABLE || !size || (size & (size - 1)))
+        error("Hash table already initialized or size not a power of two");
+    HTABLE = calloc(size, sizeof(struct htable));
     HTABLE_SIZE = size;
+    HTABLE_COUNT = 0;
     return size;
 }
 
+static void ht_place(struct object *key, uint32_t h) {
+    size_t pos = h & (HTABLE_SIZE - 1);
+    size_t dist = 0;
+    for (;;) {
+        if (HTABLE[pos].key == NULL) {
+            HTABLE[pos].key = key;
+            HTABLE[pos].hash = h;
+            return;
+        }
+        size_t existing = HT_DIST(HTABLE[pos].hash, pos);
+        if (existing < dist) {
+            struct htable tmp = HTABLE[pos];
+            HTABLE[pos].key = key;
+            HTABLE[pos].hash = h;
+            key = tmp.key;
+            h = tmp.hash;
+            dist = existing;
+        }
+        pos = (pos + 1) & (HTABLE_SIZE - 1);
+        dist++;
+    }
+}
+
+static void ht_resize(size_t size) {
+    struct htable *old = HTABLE;
+    size_t old_size = HTABLE_SIZE;
+    size_t i;
+    HTABLE = calloc(size, sizeof(struct htable));
+    if (HTABLE == NULL)
+        error("Out of memory growing symbol table");
+    HTABLE_SIZE = size;
+    for (i = 0; i < old_size; i++)
+        if (old[i].key)
+            ht_place(old[i].key, old[i].hash);
+    free(old);
+}
+
 void ht_insert(struct object *key) {
-    uint64_t h = hash(key->string);
-    HTABLE[h].key = key;
+    if (HTABLE_COUNT + 1 > HT_MAX_LOAD(HTABLE_SIZE))
+        ht_resize(HTABLE_SIZE << 1);
+    ht_place(key, key->hash);
+    HTABLE_COUNT++;
+}
+
+/* Returns the slot holding s, or -1 if it is not present. Robin Hood ordering
+   lets us stop as soon as we pass an entry closer to home than we are */
+static ssize_t ht_find(const char *s, uint32_t h) {
+    size_t pos = h & (HTABLE_SIZE - 1);
+    size_t dist = 0;
+    while (HTABLE[pos].key != NULL && dist <= HT_DIST(HTABLE[pos].hash, pos)) {
+        if (HTABLE[pos].hash == h && !strcmp(HTABLE[pos].key->string, s))
+            return pos;
+        pos = (pos + 1) & (HTABLE_SIZE - 1);
+        dist++;
+    }
+    return -1;
 }
 
-struct object *ht_lookup(char *s) {
-    uint64_t h = hash(s);
-    return HTABLE[h].key;
+struct object *ht_lookup(char *s, uint32_t h) {
+    ssize_t pos = ht_find(s, h);
+    return (pos < 0) ? NULL : HTABLE[pos].key;
 }
 
 /*==============================================================================
@@ -161,16 +229,27 @@ struct object *make_vector(int size) {
 }
 
 struct object *make_symbol(char *s) {
-    struct object *ret = ht_lookup(s);
+    uint32_t h = hash(s);
+    struct object *ret = ht_lookup(s, h);
     if (null(ret)) {
         ret = alloc();
         ret->type = SYMBOL;
         ret->string = strdup(s);
+        ret->hash = h;
         ht_insert(ret);
     }
     return ret;
 }
 
+/* Strings are not interned, the object takes ownership of the malloc'd s */
+struct object *make_string(char *s, size_t length) {
+    struct object *ret = alloc();
+    ret->type = STRING;
+    ret->string = s;
+    ret->length = length;
+    return ret;
+}
+
 struct object *make_integer(int x) {
     struct object *ret = alloc();
     ret->type = INTEGER;
@@ -241,8 +320,10 @@ bool is_equal(struct object *x, struct object *y) {
     case INTEGER:
         return x->integer == y->integer;
     case SYMBOL:
+        return false; // interned, so x == y is the only way to be equal
     case STRING:
-        return !strcmp(x->string, y->string);
+        return x->length == y->length &&
+               !memcmp(x->string, y->string, x->length);
     case PRIMITIVE:
         return false;
     case VECTOR:
@@ -574,20 +655,21 @@ void skip(FILE *in) {
 }
 
 struct object *read_string(FILE *in) {
-    char buf[256];
-    int i = 0;
+    size_t size = 32;
+    size_t i = 0;
+    char *buf = malloc(size);
     int c;
     while ((c = getc(in)) != '\"') {
-        if (c == EOF)
+        if (c == EOF) {
+            free(buf);
             return NIL;
-        if (i >= 256)
-            error("String too long - maximum length 256 characters");
+        }
+        if (i + 1 >= size)
+            buf = realloc(buf, size <<= 1);
         buf[i++] = (char)c;
     }
     buf[i] = '\0';
-    struct object *s = make_symbol(buf);
-    s->type = STRING;
-    return s;
+    return make_string(buf, i);
 }
 
 struct object *read_symbol(FILE *in, char start) {
@@ -954,8 +1036,7 @@ for (;;) {
 }
 
 int main(int argc, char **argv) {
-    int NELEM = 8191;
-    ht_init(NELEM);
+    ht_init(1024);
     init_env();
     struct object *exp;
     int i;
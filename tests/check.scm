@@ -0,0 +1,10 @@
+;;; Loaded by tests/run.sh before each test. A check prints what went wrong,
+;;; and each test prints the number of checks that failed as its last line.
+
+(define failures 0)
+(define (check name got want)
+  (if (equal? got want)
+    'ok
+    (begin
+      (print (list 'FAIL name 'got got 'want want))
+      (set! failures (+ failures 1)))))
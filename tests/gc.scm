@@ -0,0 +1,72 @@
+;;; Collector regression tests: data that stays live while garbage is made
+;;; around it must come through every kind of collection intact. A full
+;;; collection first sizes the heap by what is live, rather than by the
+;;; starting limit, so that tests/run.sh's settings bring on more of them
+
+(gc-pass)
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(define (sum list acc) (if (null? list) acc (sum (cdr list) (+ acc (car list)))))
+(define (churn n) (if (= n 0) 'done (begin (build 200 '()) (churn (- n 1)))))
+
+;;; a long list, and closures over its cells, outlive the garbage
+(define kept (build 300 '()))
+(define (adders list acc)
+  (if (null? list) acc
+    (adders (cdr list) (cons (let ((n (car list))) (lambda (x) (+ x n))) acc))))
+(define fns (adders kept '()))
+(churn 2)
+(check 'list-sum (sum kept 0) 45150)
+(check 'closure-first ((car fns) 0) 300)
+(check 'closure-last ((car (last-item-in-list fns)) 0) 1)
+
+;;; vectors small and large, the large ones in their own space
+(define (fill v i n) (if (= i n) v (begin (vector-set v i (* i i)) (fill v (+ i 1) n))))
+(define small (fill (vector 100) 0 100))
+(define large (fill (vector 5000) 4900 5000))
+(define (drop-large n) (if (= n 0) 'done (begin (vector 5000) (drop-large (- n 1)))))
+(drop-large 5)
+(churn 2)
+(check 'small-vector (vector-get small 99) 9801)
+(check 'large-vector (vector-get large 4999) 24990001)
+(vector-set large 10 (build 10 '()))
+(churn 2)
+(check 'large-vector-young (sum (vector-get large 10) 0) 55)
+;;; an index out of range leaves the vector, and what is next to it, alone
+(vector-set large -1 'before)
+(vector-set large 5000 'after)
+(check 'index-negative (vector-get large -1) (car (list)))
+(check 'index-past-end (vector-get large 5000) (car (list)))
+(drop-large 5)
+(check 'index-out-of-range-kept (vector-get large 4999) 24990001)
+
+;;; hash tables keyed by symbols, integers and strings
+(define symbols (make-hash-table))
+(define strings (make-hash-table equal?))
+(define (fill-table n)
+  (if (= n 0) 'done
+    (begin
+      (hash-table-set! symbols n (build 3 '()))
+      (hash-table-set! strings (list "key" n) n)
+      (fill-table (- n 1)))))
+(fill-table 100)
+(hash-table-set! symbols 'name "value")
+(churn 2)
+(check 'table-count (hash-table-count symbols) 101)
+(check 'table-int-key (hash-table-ref symbols 50 #f) (list 1 2 3))
+(check 'table-symbol-key (hash-table-ref symbols 'name #f) "value")
+(check 'table-equal-key (hash-table-ref strings (list "key" 71) #f) 71)
+(define (empty-table n) (if (= n 0) 'done (begin (hash-table-delete! strings (list "key" n)) (empty-table (- n 2)))))
+(empty-table 100)
+(churn 1)
+(check 'table-deleted (hash-table-count strings) 50)
+(check 'table-kept (hash-table-ref strings (list "key" 99) #f) 99)
+
+;;; old data pointing at young data, set after it was promoted
+(define holder (cons 'a 'b))
+(churn 2)
+(set-car! holder (build 5 '()))
+(churn 2)
+(check 'old-to-young (sum (car holder) 0) 15)
+
+(print failures)
+(exit)
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Regression tests: runs each test after lib.scm and tests/check.scm, tree
+# walking and on the bytecode VM (--vm), under each way the collector can run:
+#   force        built with FORCE_GC, a full collection on every allocation
+#   incremental  full collections sliced into 20us pauses
+#   parallel     full collections marked by 4 threads and swept in background
+#   image        started from a heap image of lib.scm and check.scm
+# incremental and parallel have a tiny nursery and a heap sized to what is
+# live, so that full collections come often.
+# A run passes when the last line it prints is 0, the number of failed checks.
+# usage: tests/run.sh [test.scm ...]
+DIR=$(dirname $0)
+SRC=$DIR/../scheme-gc
+LIB=$SRC/src/lib.scm
+[ $# -gt 0 ] || set -- $DIR/semantics.scm $DIR/gc.scm $DIR/tables.scm
+BUILD=$(mktemp -d /tmp/microlisp-tests-XXXXXX)
+trap 'rm -rf $BUILD' EXIT
+${CC:-cc} -O1 -Wall -DFORCE_GC -I$SRC/include $SRC/src/scheme.c \
+	-o $BUILD/force -pthread || exit 1
+${CC:-cc} -O2 -Wall -I$SRC/include $SRC/src/scheme.c \
+	-o $BUILD/microlisp -pthread || exit 1
+$BUILD/microlisp $LIB $DIR/check.scm --dump-image $BUILD/lib.img \
+	< /dev/null > /dev/null || exit 1
+
+# run mode flag test: runs the test in the given mode, with flag for the VM
+run() {
+	case $1 in
+	force)
+		$BUILD/force $2 $LIB $DIR/check.scm $3 ;;
+	incremental)
+		MICROLISP_GC_NURSERY_BYTES=4096 MICROLISP_GC_TARGET_LIVE_PCT=100 \
+		MICROLISP_GC_PAUSE_US=20 MICROLISP_GC_BACKGROUND_SWEEP=0 \
+			$BUILD/microlisp $2 $LIB $DIR/check.scm $3 ;;
+	parallel)
+		MICROLISP_GC_NURSERY_BYTES=4096 MICROLISP_GC_TARGET_LIVE_PCT=100 \
+		MICROLISP_GC_PAUSE_US=0 MICROLISP_GC_MARK_THREADS=4 \
+		MICROLISP_GC_BACKGROUND_SWEEP=1 \
+			$BUILD/microlisp $2 $LIB $DIR/check.scm $3 ;;
+	image)
+		$BUILD/microlisp $2 --image $BUILD/lib.img $3 ;;
+	esac
+}
+
+status=0
+for f in "$@"; do
+	for mode in force incremental parallel image; do
+		for flag in "" --vm; do
+			out=$(run $mode "$flag" $f < /dev/null 2>&1)
+			name="$(basename $f) $mode${flag:+ $flag}"
+			if [ "$(echo "$out" | tail -n 1)" = "0" ]; then
+				echo "$name: ok"
+			else
+				echo "$name: failed"
+				echo "$out" | grep -v "^uscheme\|^Evaluating"
+				status=1
+			fi
+		done
+	done
+done
+exit $status
@@ -0,0 +1,86 @@
+;;; Evaluator regression tests: closures, definitions and globals, which code
+;;; with its variables resolved must treat as eval does
+
+;;; a closure moved to another environment looks its free variables up there
+(define (mk a) (lambda (b) (list a b)))
+(define moved (mk 1))
+(define a 100)
+(mutate-procedure-env moved (get-global-environment))
+(check 'mutated-env (moved 2) (list 100 2))
+(define (call-moved) (moved 3))
+(check 'mutated-env-call (call-moved) (list 100 3))
+(define kept (mk 1))
+(check 'unmutated-env (kept 2) (list 1 2))
+;;; as does one given a new body or parameters, or one put together by hand
+(define (twice x) (* 2 x))
+(mutate-procedure-body twice '(* 3 x))
+(check 'mutated-body (twice 5) 15)
+(define (minus x y) (- x y))
+(mutate-procedure-args minus '(y x))
+(check 'mutated-args (minus 10 3) -7)
+(check 'constructed (new-func 5) (cons 5 10))
+
+;;; a definition that has not run yet leaves the name to the enclosing scope
+(define w 1)
+(define (h flag) (if flag (define w 2) 0) w)
+(check 'define-not-run (h #f) 1)
+(check 'define-run (h #t) 2)
+(check 'define-not-run-again (h #f) 1)
+;;; as does one at the top of the body, until it has run
+(define (before-define d) (define a w) (define w 2) a)
+(check 'define-after-use (before-define 0) 1)
+(define (list-before-define d) (define r (list w)) (define w 5) (cons w r))
+(check 'define-after-list (list-before-define 0) (list 5 1))
+(define (set-before-define d) (set! w (+ w 1)) (define w 10) w)
+(check 'set-then-define (set-before-define 0) 10)
+(check 'set-then-define-global w 2)
+(set! w 1)
+(define (h2 flag)
+  (define (inner) w)
+  (cond (flag (define w 3)))
+  (inner))
+(check 'define-not-run-inner (h2 #f) 1)
+(check 'define-run-inner (h2 #t) 3)
+(define (h3 flag)
+  (if flag (define w 4) 0)
+  (set! w (+ w 10))
+  w)
+(check 'set-before-define (h3 #f) 11)
+(check 'set-before-define-global w 11)
+(check 'set-after-define (h3 #t) 14)
+(check 'set-after-define-global w 11)
+(set! w 1)
+(define (h4)
+  (begin (define u 5) (define v (+ u 1)))
+  (let ((t 7)) (define u 8) (list t u v)))
+(check 'begin-defines (h4) (list 7 8 6))
+(define (h5 n)
+  (let loop ((i n))
+    (if (= i 0) 0 (loop (- i 1)))))
+(check 'named-let (h5 10) 0)
+(define (h6 n)
+  (+ 1 (let loop ((i n)) (if (= i 0) 0 (+ 2 (loop (- i 1)))))))
+(check 'nested-named-let (h6 5) 11)
+
+;;; a global referred to before it is defined is unbound until it is, and
+;;; mentioning it does not define it
+(define (global-names) (car (car (get-global-environment))))
+(define (has-name? name names)
+  (if (null? names) #f (if (eq? name (car names)) #t (has-name? name (cdr names)))))
+(define (uses-later x) (later-defined x))
+(define (mentions-undefined) never-defined)
+(check 'undefined-value (mentions-undefined) (car (list)))
+(check 'undefined-not-bound (has-name? 'never-defined (global-names)) #f)
+(set! never-defined 5)
+(check 'set-undefined (mentions-undefined) (car (list)))
+(check 'set-undefined-not-bound (has-name? 'never-defined (global-names)) #f)
+(define (later-defined x) (* x 2))
+(check 'forward-reference (uses-later 5) 10)
+(check 'forward-reference-bound (has-name? 'later-defined (global-names)) #t)
+(define never-defined 7)
+(check 'defined-after-mention (mentions-undefined) 7)
+(define never-defined 8)
+(check 'redefined-after-mention (mentions-undefined) 8)
+
+(print failures)
+(exit)
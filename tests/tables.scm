@@ -0,0 +1,31 @@
+;;; Hash table regression tests: what keys are the same, and what tables are
+;;; equal to
+
+;;; tables are equal? only to themselves
+(define table (make-hash-table))
+(hash-table-set! table 'k 1)
+(check 'table-equal-self (equal? table table) #t)
+(check 'table-equal-other (equal? table (make-hash-table)) #f)
+(check 'table-ref (hash-table-ref table 'k) 1)
+
+;;; equal? compares lists all the way down, as tables made with it do
+(check 'equal-nested (equal? (list (list 1 2) "s") (list (list 1 2) "s")) #t)
+(check 'equal-nested-differ (equal? (list (list 1 2)) (list (list 1 3))) #f)
+(check 'equal-prefix (equal? (list 1 2) (list 1)) #f)
+(check 'equal-empty (equal? (list) (list 1)) #f)
+(define by-value (make-hash-table equal?))
+(hash-table-set! by-value (list (list 1) 2) 'nested)
+(hash-table-set! by-value (list 1) 'short)
+(hash-table-set! by-value (list 1 2) 'long)
+(check 'table-equal-count (hash-table-count by-value) 3)
+(check 'table-equal-nested (hash-table-ref by-value (list (list 1) 2) #f) 'nested)
+(check 'table-equal-short (hash-table-ref by-value (list 1) #f) 'short)
+
+;;; a circular key hashes, and is found by itself
+(define circular (list 1 2))
+(set-cdr! (cdr circular) circular)
+(hash-table-set! by-value circular 'circular)
+(check 'table-circular-key (hash-table-ref by-value circular #f) 'circular)
+
+(print failures)
+(exit)